@@ -4,222 +4,7312 @@ Soporta comandos internos y externos.
 */
 
 // ==================== INCLUDES ====================
+#ifndef _WIN32
+#define _GNU_SOURCE // memrchr, MAP_POPULATE y demás extensiones de glibc
+#endif
+
 #include <stdio.h>  // Funciones de entrada/salida: printf, perror, fgets
 #include <stdlib.h> // Gestión de memoria dinámica: malloc, free, exit
 #include <string.h> // Manipulación de strings: strtok, strcmp, strcspn
+#include <ctype.h>  // isalpha, isdigit, isalnum (nombres de variables)
+#include <errno.h>  // errno, EINTR
+#include <fcntl.h>  // open, O_RDONLY, O_CREAT (redirecciones)
+#include <stdint.h> // uint64_t (hashes, estadísticas)
+#include <time.h>   // time (caducidad de memo)
+#include <stdarg.h> // va_list (out_printf)
 
 // Inclusión de librerías específicas del sistema operativo
 #ifdef _WIN32
 #include <process.h> // _spawnvp (creación de procesos en Windows)
 #include <direct.h>  // _chdir (cambio de directorio en Windows)
+#include <io.h>      // _dup, _dup2, _read (redirecciones en Windows)
 #else
 #include <unistd.h>    // chdir, fork, execvp (Unix)
 #include <sys/types.h> // Tipos de datos para procesos (Unix)
 #include <sys/wait.h>  // waitpid (espera de procesos en Unix)
+#include <sys/stat.h>  // fstat (detectar archivos regulares)
+#include <sys/mman.h>  // mmap (contadores compartidos, imagen de estado, io_uring)
+#include <poll.h>      // poll (espera de datos de coprocesos)
+#include <signal.h>    // signal, SIGPIPE (fanout)
+#include <pthread.h>   // Etapas de tubería en hilos
+#include <sys/resource.h> // getrusage (tiempo de CPU y RSS máximo en --stats)
+#include <regex.h>        // regcomp, regexec ([[ =~ ]])
+#include <fnmatch.h>      // fnmatch (patrones de [[ == ]])
 #endif
 
-// ==================== read_line ====================
+#ifndef O_BINARY
+#define O_BINARY 0 // Solo existe en Windows (evita la conversión de \r\n)
+#endif
+
+// ==================== estadísticas ====================
 /*
-Lee una línea de entrada desde el teclado.
-- Reserva 1024 bytes de memoria.
-- Maneja Ctrl+Z (Windows) o Ctrl+D (Unix) para salir.
-- Retorna: Puntero a la cadena leída (debe liberarse con free()).
+Contadores de coste por comando y por sesión (builtin 'stats', --stats).
+- Viven en una página MAP_SHARED anónima creada en stats_init(), así los
+  hijos (fallos de exec en la búsqueda del PATH, subshells, zygote) suman
+  en los mismos contadores que ve el shell.
+- STAT_ADD es un incremento atómico relajado: coste despreciable incluso
+  con etapas de tubería en hilos.
 */
-char *read_line(void)
+enum stat_id
 {
-    size_t bufsize = 1024;
-    char *line = malloc(bufsize);
+    ST_COMMANDS,
+    ST_ALLOCS,
+    ST_ALLOC_BYTES,
+    ST_FORKS,
+    ST_EXECS,
+    ST_EXEC_FAILS, // execv fallidos probando directorios del PATH
+    ST_READS,
+    ST_WRITES,
+    ST_KCOPIES,  // splice/tee/sendfile/copy_file_range
+    ST_RING_OPS, // Aperturas y stats enviadas en lote por io_uring
+    ST_COUNT
+};
 
-    // Verificar asignación de memoria
-    if (!line)
-    {
-        fprintf(stderr, "shell: error de asignación de memoria\n");
-        exit(EXIT_FAILURE);
-    }
+static const char *stat_names[ST_COUNT] = {
+    "commands", "allocs", "alloc_bytes", "forks", "execs",
+    "exec_failures", "reads", "writes", "kernel_copies", "ring_ops"};
+
+static uint64_t stats_local[ST_COUNT];
+static uint64_t *stats = stats_local; // Página compartida tras stats_init()
+
+#define STAT_ADD(id, n) __atomic_fetch_add(&stats[id], (uint64_t)(n), __ATOMIC_RELAXED)
+
+static uint64_t session_t0; // Arranque (µs), para el tiempo total de --stats
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000;
+}
 
-    // Leer entrada con fgets
-    if (fgets(line, bufsize, stdin) == NULL)
+void stats_init(void)
+{
+    session_t0 = now_us();
+#ifndef _WIN32
+    void *page = mmap(NULL, sizeof(stats_local), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (page != MAP_FAILED)
     {
-        if (feof(stdin))
-        { // Caso: EOF (usuario termina la entrada)
-            printf("\n");
-            exit(EXIT_SUCCESS);
-        }
-        perror("fgets"); // Error de lectura
-        exit(EXIT_FAILURE);
+        memcpy(page, stats_local, sizeof(stats_local));
+        stats = page;
     }
-    return line;
+#endif
 }
 
-// ==================== split_line ====================
+// ==================== sondas USDT ====================
 /*
-Divide la línea en tokens (palabras) usando delimitadores.
-- Delimitadores: espacios, tabs, retornos de carro y saltos de línea.
-- Retorna: Array de punteros a tokens terminado en NULL (debe liberarse con free()).
+Puntos de traza estáticos para perf/bpftrace (proveedor "shell"):
+- read_line(longitud, ns)       al terminar de leer una línea
+- split_line(tokens, ns)        al terminar de dividirla
+- builtin(nombre, estado, ns)   al volver de un builtin
+- spawn(nombre, pid)            tras crear un proceso externo
+- reap(pid, estado, ns)         al recogerlo (ns desde el spawn)
+- Solo existen si hay <sys/sdt.h> (paquete systemtap-sdt-dev); si no, o
+  con -DSHELL_NO_SDT, las macros no generan código. Ver tools/bpftrace/.
 */
-#define TOK_BUFSIZE 64      // Tamaño inicial del array de tokens
-#define TOK_DELIM " \t\r\n" // Caracteres delimitadores
+#if defined(__has_include) && !defined(SHELL_NO_SDT)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define SHELL_SDT 1
+#endif
+#endif
 
-char **split_line(char *line)
+#ifdef SHELL_SDT
+#define PROBE2(name, a, b) DTRACE_PROBE2(shell, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(shell, name, a, b, c)
+
+static uint64_t probe_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+#else
+#define PROBE2(name, a, b) ((void)(a), (void)(b))
+#define PROBE3(name, a, b, c) ((void)(a), (void)(b), (void)(c))
+#define probe_now() ((uint64_t)0)
+#endif
+
+// ==================== memoria ====================
+/*
+Envoltorios de malloc/realloc/strdup que abortan el shell si no hay memoria.
+Evitan repetir la comprobación en cada reserva.
+*/
+static void die_nomem(void)
+{
+    fprintf(stderr, "shell: error de asignación de memoria\n");
+    exit(EXIT_FAILURE);
+}
+
+static void *xmalloc(size_t size)
+{
+    STAT_ADD(ST_ALLOCS, 1);
+    STAT_ADD(ST_ALLOC_BYTES, size);
+    void *p = malloc(size);
+    if (!p)
+        die_nomem();
+    return p;
+}
+
+static void *xrealloc(void *ptr, size_t size)
+{
+    STAT_ADD(ST_ALLOCS, 1);
+    STAT_ADD(ST_ALLOC_BYTES, size);
+    void *p = realloc(ptr, size);
+    if (!p)
+        die_nomem();
+    return p;
+}
+
+static char *xstrdup(const char *s)
+{
+    size_t len = strlen(s) + 1;
+    return memcpy(xmalloc(len), s, len);
+}
+
+// ==================== llamadas al sistema ====================
+/*
+Envoltorios de read/write/fork/exec que alimentan las estadísticas y
+esconden las diferencias Windows/Unix.
+*/
+static ssize_t sh_read(int fd, void *buf, size_t len)
+{
+    STAT_ADD(ST_READS, 1);
+#ifdef _WIN32
+    return _read(fd, buf, (unsigned)len);
+#else
+    return read(fd, buf, len);
+#endif
+}
+
+static ssize_t sh_write(int fd, const void *buf, size_t len)
+{
+    STAT_ADD(ST_WRITES, 1);
+#ifdef _WIN32
+    return _write(fd, buf, (unsigned)len);
+#else
+    return write(fd, buf, len);
+#endif
+}
+
+static void env_sync(void);
+
+#ifndef _WIN32
+static pid_t sh_fork(void)
+{
+    STAT_ADD(ST_FORKS, 1);
+    env_sync(); // El hijo hereda el entorno: que lleve lo exportado al día
+    return fork();
+}
+
+// Script sin #! ('file' dio ENOEXEC): lo ejecuta /bin/sh, como execvp. Solo retorna si falla
+static void exec_script(const char *file, char **argv)
+{
+    size_t argc = 0;
+    while (argv[argc])
+        argc++;
+    char **sh_argv = xmalloc((argc + 2) * sizeof(char *));
+    sh_argv[0] = "sh";
+    sh_argv[1] = (char *)file;
+    memcpy(sh_argv + 2, argv + 1, argc * sizeof(char *));
+    execv("/bin/sh", sh_argv);
+    free(sh_argv);
+}
+
+/*
+Igual que execvp, pero recorriendo el PATH a mano para contar cada
+intento fallido. Solo retorna si no se pudo ejecutar (errno indica por qué).
+*/
+int exec_command(char **argv)
 {
-    int bufsize = TOK_BUFSIZE;
-    int pos = 0;
-    char **tokens = malloc(bufsize * sizeof(char *));
+    const char *name = argv[0];
+    STAT_ADD(ST_EXECS, 1);
 
-    if (!tokens)
+    if (strchr(name, '/'))
     {
-        fprintf(stderr, "shell: error de asignación de memoria\n");
-        exit(EXIT_FAILURE);
+        execv(name, argv);
+        STAT_ADD(ST_EXEC_FAILS, 1);
+        if (errno == ENOEXEC)
+            exec_script(name, argv);
+        return -1;
     }
 
-    // Primer token usando strtok
-    char *tok = strtok(line, TOK_DELIM);
+    const char *path = getenv("PATH");
+    if (!path)
+        path = "/usr/local/bin:/usr/bin:/bin";
 
-    while (tok != NULL)
+    int saw_eacces = 0;
+    size_t name_len = strlen(name);
+    char *buf = xmalloc(strlen(path) + name_len + 2);
+
+    for (const char *dir = path;; dir++)
     {
-        tokens[pos++] = tok;
+        const char *end = strchr(dir, ':');
+        size_t dir_len = end ? (size_t)(end - dir) : strlen(dir);
+        if (dir_len == 0)
+        { // Entrada vacía = directorio actual
+            buf[0] = '.';
+            dir_len = 1;
+        }
+        else
+            memcpy(buf, dir, dir_len);
+        buf[dir_len] = '/';
+        memcpy(buf + dir_len + 1, name, name_len + 1);
 
-        // Redimensionar array si es necesario
-        if (pos >= bufsize)
+        execv(buf, argv);
+        STAT_ADD(ST_EXEC_FAILS, 1);
+        if (errno == EACCES)
+            saw_eacces = 1;
+        else if (errno == ENOEXEC)
         {
-            bufsize += TOK_BUFSIZE;
-            tokens = realloc(tokens, bufsize * sizeof(char *));
-
-            if (!tokens)
-            {
-                fprintf(stderr, "shell: error de asignación de memoria\n");
-                exit(EXIT_FAILURE);
-            }
+            exec_script(buf, argv);
+            break;
         }
 
-        tok = strtok(NULL, TOK_DELIM); // Siguiente token
+        if (!end)
+            break;
+        dir = end;
     }
 
-    tokens[pos] = NULL; // Marca final del array
-    return tokens;
+    free(buf);
+    errno = saw_eacces ? EACCES : ENOENT;
+    return -1;
 }
+#endif
 
-// ==================== launch ====================
+// ==================== strbuf ====================
 /*
-Ejecuta el comando recibido.
-- Maneja comandos internos: exit, echo, cd.
-- Ejecuta comandos externos según el sistema operativo.
-- Retorna: 1 para continuar ejecución, 0 para terminar.
+Buffer de texto que crece duplicando su capacidad.
+- Se usa para construir la línea expandida sin límite de tamaño.
 */
-int launch(char **args)
+struct strbuf
 {
-    if (!args[0])
-        return 1; // Línea vacía
+    char *data;
+    size_t len;
+    size_t cap;
+};
 
-    // ------ Comando: exit ------
-    if (strcmp(args[0], "exit") == 0)
+static void sb_reserve(struct strbuf *sb, size_t extra)
+{
+    if (sb->len + extra + 1 <= sb->cap)
+        return;
+
+    size_t cap = sb->cap ? sb->cap : 64;
+    while (sb->len + extra + 1 > cap)
+        cap *= 2;
+    sb->data = xrealloc(sb->data, cap);
+    sb->cap = cap;
+}
+
+static void sb_append(struct strbuf *sb, const char *s, size_t n)
+{
+    sb_reserve(sb, n);
+    memcpy(sb->data + sb->len, s, n);
+    sb->len += n;
+    sb->data[sb->len] = '\0';
+}
+
+static void sb_putc(struct strbuf *sb, char c)
+{
+    sb_append(sb, &c, 1);
+}
+
+// ==================== variables ====================
+/*
+Almacén de variables del shell.
+- Cada variable es un array de "spans" (puntero + longitud); un escalar es un
+  array de un solo elemento.
+- Los spans apuntan a un bloque de respaldo que pertenece a la variable: un
+  bloque del heap (mapfile copia ahí la entrada entera y cada línea es un
+  span dentro de él, sin un malloc por línea) o la imagen de --load-state.
+- Un escalar puede llevar además su valor entero (has_int). La aritmética
+  asigna solo el entero (int_only) y el texto se crea con var_text() cuando
+  alguien lo expande, lo exporta o lo guarda: un contador que nadie lee no
+  se convierte nunca a texto.
+*/
+#define VAR_BUCKETS 256 // Número de listas de la tabla hash
+
+struct span
+{
+    const char *ptr;
+    size_t len;
+};
+
+enum backing_kind
+{
+    BACK_NONE,
+    BACK_HEAP,  // Bloque reservado con malloc
+    BACK_IMAGE  // Imagen de estado compartida (--load-state): no se libera
+};
+
+struct var
+{
+    char *name;
+    struct span *items;
+    size_t count;
+    void *backing;
+    size_t backing_len;
+    enum backing_kind backing_kind;
+    int64_t ival; // Valor entero (válido si has_int)
+    int has_int;
+    int int_only; // Aún sin forma de texto (items vacío)
+    int exported;  // Marcada con export: su valor va al entorno
+    int env_stale; // Cambió desde la última copia al entorno
+    struct var *next;
+};
+
+static struct var *var_table[VAR_BUCKETS];
+static unsigned long state_gen = 0; // Cambia con cada modificación (ver zygote)
+static int env_dirty = 0;           // Alguna variable exportada tiene env_stale
+
+static unsigned var_hash(const char *name, size_t len)
+{
+    unsigned h = 5381;
+    for (size_t i = 0; i < len; i++)
+        h = h * 33 + (unsigned char)name[i];
+    return h % VAR_BUCKETS;
+}
+
+static struct var *var_lookup(const char *name, size_t len)
+{
+    for (struct var *v = var_table[var_hash(name, len)]; v; v = v->next)
     {
-        return 0; // Señal para terminar el shell
+        if (strlen(v->name) == len && memcmp(v->name, name, len) == 0)
+            return v;
     }
+    return NULL;
+}
+
+// Libera el contenido de la variable (no el nodo ni el nombre)
+static void var_clear(struct var *v)
+{
+    if (v->backing_kind == BACK_HEAP)
+        free(v->backing);
+    free(v->items);
+    v->items = NULL;
+    v->count = 0;
+    v->backing = NULL;
+    v->backing_len = 0;
+    v->backing_kind = BACK_NONE;
+    v->has_int = 0;
+    v->int_only = 0;
+}
 
-    // ------ Comando: echo ------
-    if (strcmp(args[0], "echo") == 0)
+// Devuelve la variable (creándola vacía si no existe)
+static struct var *var_get(const char *name)
+{
+    size_t len = strlen(name);
+    state_gen++;
+    struct var *v = var_lookup(name, len);
+    if (v)
     {
-        for (int i = 1; args[i]; i++)
-        {
-            printf("%s%s", args[i], args[i + 1] ? " " : "");
-        }
-        printf("\n");
-        return 1;
+        var_clear(v);
+        if (v->exported)
+            v->env_stale = env_dirty = 1; // Se copia al entorno antes del próximo fork
+        return v;
     }
 
-    // ------ Comando: cd ------
-    if (strcmp(args[0], "cd") == 0)
+    unsigned h = var_hash(name, len);
+    v = xmalloc(sizeof(*v));
+    memset(v, 0, sizeof(*v));
+    v->name = xstrdup(name);
+    v->next = var_table[h];
+    var_table[h] = v;
+    return v;
+}
+
+// Asigna una lista de palabras copiándolas a un único bloque del heap
+static void var_set_words(const char *name, const char **words, size_t n)
+{
+    struct var *v = var_get(name);
+    size_t total = 0;
+
+    for (size_t i = 0; i < n; i++)
+        total += strlen(words[i]) + 1;
+
+    char *block = xmalloc(total ? total : 1);
+    v->backing = block;
+    v->backing_len = total;
+    v->backing_kind = BACK_HEAP;
+    v->items = xmalloc((n ? n : 1) * sizeof(struct span));
+    v->count = n;
+
+    for (size_t i = 0; i < n; i++)
     {
-        char *dir = args[1] ? args[1] : getenv("HOME");
+        size_t len = strlen(words[i]);
+        memcpy(block, words[i], len + 1);
+        v->items[i].ptr = block;
+        v->items[i].len = len;
+        block += len + 1;
+    }
+}
 
-#ifdef _WIN32
-        if (_chdir(dir) != 0)
+static void var_set_scalar(const char *name, const char *value)
+{
+    var_set_words(name, &value, 1);
+}
+
+// Asigna un entero sin convertirlo a texto
+static void var_set_int(const char *name, int64_t value)
+{
+    struct var *v = var_get(name);
+    v->ival = value;
+    v->has_int = 1;
+    v->int_only = 1;
+}
+
+// Crea la forma de texto de una variable entera. Retorna: la misma variable
+static struct var *var_text(struct var *v)
+{
+    if (v && v->int_only)
+    {
+        char num[32];
+        int n = snprintf(num, sizeof(num), "%lld", (long long)v->ival);
+        v->backing = memcpy(xmalloc(n + 1), num, n + 1);
+        v->backing_len = n + 1;
+        v->backing_kind = BACK_HEAP;
+        v->items = xmalloc(sizeof(struct span));
+        v->items[0].ptr = v->backing;
+        v->items[0].len = n;
+        v->count = 1;
+        v->int_only = 0;
+    }
+    return v;
+}
+
+/*
+Copia al entorno las variables exportadas que cambiaron desde la última
+vez (con su forma de texto, que en las enteras se crea aquí).
+- Se llama antes de crear un proceso; sin cambios no recorre nada.
+*/
+static void env_sync(void)
+{
+    if (!env_dirty)
+        return;
+    env_dirty = 0;
+    for (size_t b = 0; b < VAR_BUCKETS; b++)
+    {
+        for (struct var *v = var_table[b]; v; v = v->next)
         {
+            if (!v->exported || !v->env_stale)
+                continue;
+            v->env_stale = 0;
+            var_text(v);
+            if (!v->count)
+                continue; // Exportada pero sin valor todavía
+            char *value = memcpy(xmalloc(v->items[0].len + 1), v->items[0].ptr, v->items[0].len);
+            value[v->items[0].len] = '\0';
+#ifdef _WIN32
+            _putenv_s(v->name, value);
 #else
-        if (chdir(dir) != 0)
-        {
+            setenv(v->name, value, 1);
 #endif
-            perror("shell");
+            free(value);
         }
-        return 1;
     }
+}
 
-// ------ Comandos externos ------
-#ifdef _WIN32
-    // Windows: Usar cmd.exe con /C para ejecutar comandos
-    int arg_count = 0;
-    while (args[arg_count])
-        arg_count++;
+// El span es un entero decimal completo (con signo opcional)
+static int parse_int(const char *s, size_t len, int64_t *out)
+{
+    char num[32];
+    char *end;
 
-    // Crear array: ["cmd.exe", "/C", comando..., NULL]
-    char **cmd_args = malloc((arg_count + 3) * sizeof(char *));
-    cmd_args[0] = "cmd.exe";
-    cmd_args[1] = "/C";
+    if (len == 0 || len >= sizeof(num))
+        return 0;
+    memcpy(num, s, len);
+    num[len] = '\0';
+    errno = 0;
+    *out = strtoll(num, &end, 10);
+    return !*end && errno == 0 && !isspace((unsigned char)*num);
+}
 
-    for (int i = 0; i <= arg_count; i++)
+// NOMBRE=VALOR: retorna la posición del '=' o NULL si no es una asignación
+static char *assignment(const char *word)
+{
+    const char *p = word;
+    if (!isalpha((unsigned char)*p) && *p != '_')
+        return NULL;
+    while (isalnum((unsigned char)*p) || *p == '_')
+        p++;
+    return *p == '=' ? (char *)p : NULL;
+}
+
+/*
+Asigna un valor de texto; si es un entero se guarda también como tal,
+así la aritmética posterior no vuelve a convertirlo.
+*/
+static void var_assign(const char *name, const char *value)
+{
+    int64_t n;
+    var_set_scalar(name, value);
+    if (parse_int(value, strlen(value), &n))
     {
-        cmd_args[i + 2] = args[i];
+        struct var *v = var_lookup(name, strlen(name));
+        v->ival = n;
+        v->has_int = 1;
     }
+}
 
-    // Ejecutar y esperar
-    if (_spawnvp(_P_WAIT, "cmd.exe", (const char *const *)cmd_args) == -1)
+static int valid_name(const char *name)
+{
+    if (!isalpha((unsigned char)*name) && *name != '_')
+        return 0;
+    for (name++; *name; name++)
     {
-        perror("shell");
+        if (!isalnum((unsigned char)*name) && *name != '_')
+            return 0;
     }
-    free(cmd_args);
+    return 1;
+}
 
-#else
-    // Unix: Crear proceso hijo
-    pid_t pid = fork();
+// ==================== expand_line ====================
+/*
+Expande las referencias a variables antes de dividir la línea.
+- $NOMBRE, ${NOMBRE}, ${NOMBRE[i]}, ${NOMBRE[@]}, ${#NOMBRE}, ${#NOMBRE[@]}, $?
+  y $((EXPR)) (ver la sección de aritmética).
+- Si la variable no existe en el shell se busca en el entorno (getenv).
+- <(cmd) y >(cmd) al inicio de una palabra lanzan cmd conectado a un pipe
+  y se sustituyen por /dev/fd/N (solo Unix).
+- Coste lineal en la entrada: cada ')' se empareja una sola vez y una '{'
+  sin cerrar no se vuelve a buscar.
+- La salida no puede pasar de EXPAND_MAX bytes (p. ej. "$x $x $x ..." con x
+  enorme): se aborta con un error en lugar de agotar la memoria.
+- Retorna: Nueva cadena (debe liberarse con free()), o NULL si se superó
+  el límite o falló una expresión aritmética.
+*/
+#ifndef EXPAND_MAX
+#define EXPAND_MAX (64 * 1024 * 1024) // Bytes máximos producidos por una expansión
+#endif
 
-    if (pid < 0)
-    { // Error en fork
-        perror("shell");
+static int last_status = 0; // Código de salida del último comando ($?)
+
+#ifndef _WIN32
+static int procsub_spawn(const char *cmd, size_t len, int reading);
+#endif
+static int arith_eval(const char *src, size_t len, int64_t *result);
+
+static void append_items(struct strbuf *sb, const struct var *v, size_t from, size_t to)
+{
+    for (size_t i = from; i < to && i < v->count; i++)
+    {
+        if (i > from)
+            sb_putc(sb, ' ');
+        sb_append(sb, v->items[i].ptr, v->items[i].len);
     }
-    else if (pid == 0)
-    { // Proceso hijo
-        if (execvp(args[0], args) == -1)
-        {
-            perror("shell");
-            exit(EXIT_FAILURE);
-        }
+}
+
+static void expand_ref(struct strbuf *sb, const char *name, size_t len,
+                       const char *index, size_t index_len, int want_count)
+{
+    struct var *v = var_text(var_lookup(name, len));
+
+    if (want_count)
+    {
+        char num[32];
+        size_t n = 0;
+        if (v && !index)
+            n = v->count ? v->items[0].len : 0; // ${#NOMBRE}: longitud
+        else if (v)
+            n = (*index == '@' || *index == '*') ? v->count : 1;
+        snprintf(num, sizeof(num), "%zu", n);
+        sb_append(sb, num, strlen(num));
+        return;
     }
+
+    if (!v)
+    {
+        // Fuera del shell: buscar en el entorno
+        char *key = memcpy(xmalloc(len + 1), name, len);
+        key[len] = '\0';
+        const char *env = index ? NULL : getenv(key);
+        if (env)
+            sb_append(sb, env, strlen(env));
+        free(key);
+        return;
+    }
+
+    if (!index)
+        append_items(sb, v, 0, 1);
+    else if (index_len == 1 && (*index == '@' || *index == '*'))
+        append_items(sb, v, 0, v->count);
     else
-    { // Proceso padre
-        int status;
-        waitpid(pid, &status, WUNTRACED); // Esperar al hijo
+    {
+        size_t i = strtoul(index, NULL, 10);
+        append_items(sb, v, i, i + 1);
     }
-#endif
+}
 
-    return 1; // Continuar ejecución
+// Pareja de cada '(' de la línea (NULL si no se cierra), en una sola pasada
+static const char **paren_pairs(const char *line)
+{
+    size_t len = strlen(line), depth = 0;
+    const char **pairs = xmalloc((len + 1) * sizeof(*pairs));
+    size_t *open = xmalloc((len + 1) * sizeof(*open));
+
+    for (size_t i = 0; i < len; i++)
+    {
+        pairs[i] = NULL;
+        if (line[i] == '(')
+            open[depth++] = i;
+        else if (line[i] == ')' && depth > 0)
+            pairs[open[--depth]] = line + i;
+    }
+    free(open);
+    return pairs;
 }
 
-// ==================== main ====================
-/*
-Función principal del shell.
-- Bucle infinito: prompt → leer → dividir → ejecutar → liberar memoria.
-*/
-int main(void)
+char *expand_line(const char *line)
 {
-    char *line;
-    char **tokens;
-    int status;
+    struct strbuf sb = {0};
+    const char *p = line;
+    int brace_open = 1; // 0 tras una '{' sin '}': no quedan más '}' delante
+    const char **pairs = NULL; // paren_pairs(), solo si aparece "<(", ">(" o "$(("
 
-    do
+    while (*p)
     {
-        printf("shell> "); // Mostrar prompt
-        fflush(stdout);    // Asegurar que se imprime
+        if (sb.len > EXPAND_MAX)
+        {
+            fprintf(stderr, "shell: expansión demasiado grande (más de %d bytes)\n", EXPAND_MAX);
+            free(pairs);
+            free(sb.data);
+            return NULL;
+        }
+#ifdef _WIN32
+        const char *dollar = strchr(p, '$');
+#else
+        const char *dollar = strpbrk(p, "$<>");
+#endif
+        if (!dollar)
+        {
+            sb_append(&sb, p, strlen(p));
+            break;
+        }
+        sb_append(&sb, p, dollar - p);
+        p = dollar + 1;
 
-        line = read_line();        // Leer línea
-        tokens = split_line(line); // Dividir en tokens
-        status = launch(tokens);   // Ejecutar comando
+#ifndef _WIN32
+        if (*dollar != '$')
+        { // '<' o '>': sustitución de procesos si abre "(" al inicio de palabra
+            int word_start = dollar == line || isspace((unsigned char)dollar[-1]);
+            const char *end = NULL;
+            if (*p == '(' && word_start)
+            {
+                if (!pairs)
+                    pairs = paren_pairs(line);
+                end = pairs[p - line];
+            }
+            if (!end)
+            {
+                sb_putc(&sb, *dollar);
+                continue;
+            }
 
-        // Liberar memoria
-        free(tokens);
-        free(line);
+            int fd = procsub_spawn(p + 1, end - p - 1, *dollar == '<');
+            char path[32];
+            snprintf(path, sizeof(path), "/dev/fd/%d", fd);
+            if (fd >= 0)
+                sb_append(&sb, path, strlen(path));
+            p = end + 1;
+            continue;
+        }
+#endif
 
-    } while (status); // Continuar hasta recibir 'exit'
+        if (p[0] == '(' && p[1] == '(')
+        { // $((EXPR)): los dos paréntesis exteriores deben cerrarse juntos
+            if (!pairs)
+                pairs = paren_pairs(line);
+            const char *end = pairs[p - line];
+            int64_t value;
+            if (!end || end[-1] != ')' || pairs[p + 1 - line] != end - 1)
+            {
+                sb_putc(&sb, '$');
+                continue;
+            }
+            if (arith_eval(p + 2, end - p - 3, &value) != 0)
+            {
+                free(pairs);
+                free(sb.data);
+                return NULL;
+            }
+            char num[32];
+            snprintf(num, sizeof(num), "%lld", (long long)value);
+            sb_append(&sb, num, strlen(num));
+            p = end + 1;
+        }
+        else if (*p == '?')
+        {
+            char num[16];
+            snprintf(num, sizeof(num), "%d", last_status);
+            sb_append(&sb, num, strlen(num));
+            p++;
+        }
+        else if (*p == '{')
+        {
+            const char *end = brace_open ? strchr(p, '}') : NULL;
+            const char *name = p + 1;
+            int want_count = 0;
+            if (!end)
+            { // Llave sin cerrar: se copia literal
+                brace_open = 0;
+                sb_putc(&sb, '$');
+                continue;
+            }
+            if (*name == '#')
+            {
+                want_count = 1;
+                name++;
+            }
+            const char *bracket = memchr(name, '[', end - name);
+            size_t name_len = (bracket ? bracket : end) - name;
+            const char *index = NULL;
+            size_t index_len = 0;
+            if (bracket)
+            {
+                index = bracket + 1;
+                const char *close = memchr(index, ']', end - index);
+                index_len = (close ? close : end) - index;
+            }
+            expand_ref(&sb, name, name_len, index, index_len, want_count);
+            p = end + 1;
+        }
+        else if (isalpha((unsigned char)*p) || *p == '_')
+        {
+            const char *name = p;
+            while (isalnum((unsigned char)*p) || *p == '_')
+                p++;
+            expand_ref(&sb, name, p - name, NULL, 0, 0);
+        }
+        else
+            sb_putc(&sb, '$'); // '$' suelto: literal
+    }
 
-    return EXIT_SUCCESS;
-}
\ No newline at end of file
+    free(pairs);
+    if (!sb.data)
+        return xstrdup("");
+    return sb.data;
+}
+
+// ==================== entrada ====================
+/*
+Fuente de las líneas que lee el shell: stdin, o una sesión grabada.
+- --record ARCHIVO guarda cada trozo leído con su instante (µs desde el
+  arranque): "SHREC1\n" y después registros "<µs> <bytes>\n<datos>".
+- --replay ARCHIVO [--speed N] lee esos trozos en lugar de stdin,
+  respetando los tiempos originales divididos por N (0 = sin esperas),
+  para medir read_line()/el despachador con una secuencia reproducible.
+*/
+#ifdef _WIN32
+#include <windows.h> // Sleep
+#endif
+
+#define RECORD_MAGIC "SHREC1\n"
+
+static FILE *record_file = NULL;
+static FILE *replay_file = NULL;
+static double replay_speed = 1.0;
+static uint64_t input_t0;    // Arranque (µs)
+static uint64_t replay_prev; // Instante del último registro reproducido
+static int replay_done = 0;
+static int interactive = 1; // Prompt y salto final solo ante un terminal (o reproducción)
+static FILE *input_stream;  // NULL = stdin (el arnés de fuzzing usa un fmemopen)
+
+static void sleep_us(uint64_t us)
+{
+#ifdef _WIN32
+    Sleep((DWORD)(us / 1000));
+#else
+    struct timespec ts = {(time_t)(us / 1000000), (long)(us % 1000000) * 1000};
+    while (nanosleep(&ts, &ts) < 0 && errno == EINTR)
+        ;
+#endif
+}
+
+int input_record(const char *path)
+{
+    record_file = fopen(path, "wb");
+    if (!record_file)
+    {
+        fprintf(stderr, "shell: --record %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    fputs(RECORD_MAGIC, record_file);
+    input_t0 = now_us();
+    return 0;
+}
+
+int input_replay(const char *path, double speed)
+{
+    char magic[sizeof(RECORD_MAGIC)] = {0};
+    replay_file = fopen(path, "rb");
+    if (!replay_file || !fgets(magic, sizeof(magic), replay_file) || strcmp(magic, RECORD_MAGIC) != 0)
+    {
+        fprintf(stderr, "shell: --replay %s: %s\n", path, replay_file ? "formato inválido" : strerror(errno));
+        return -1;
+    }
+    replay_speed = speed;
+    return 0;
+}
+
+// Siguiente trozo grabado. Retorna: NULL al terminar la grabación
+static char *replay_gets(char *buf, int size)
+{
+    unsigned long long at;
+    size_t len;
+
+    if (fscanf(replay_file, "%llu %zu", &at, &len) != 2 || fgetc(replay_file) != '\n' ||
+        len >= (size_t)size || fread(buf, 1, len, replay_file) != len)
+    {
+        replay_done = 1;
+        return NULL;
+    }
+    buf[len] = '\0';
+
+    if (replay_speed > 0 && at > replay_prev)
+        sleep_us((uint64_t)((at - replay_prev) / replay_speed));
+    replay_prev = at;
+    return buf;
+}
+
+// Como fgets(buf, size, stdin), pero pasando por la grabación/reproducción
+char *input_gets(char *buf, int size)
+{
+    char *got = replay_file ? replay_gets(buf, size)
+                            : fgets(buf, size, input_stream ? input_stream : stdin);
+
+    if (got && record_file)
+    {
+        size_t len = strlen(got);
+        fprintf(record_file, "%llu %zu\n", (unsigned long long)(now_us() - input_t0), len);
+        fwrite(got, 1, len, record_file);
+        fflush(record_file); // Que la grabación sobreviva a un cierre brusco
+    }
+    return got;
+}
+
+static int input_eof(void)
+{
+    return replay_file ? replay_done : feof(input_stream ? input_stream : stdin);
+}
+
+// ==================== read_line ====================
+/*
+Lee una línea de entrada desde el teclado.
+- Reserva inicialmente 1024 bytes de memoria.
+- Maneja Ctrl+Z (Windows) o Ctrl+D (Unix) para salir.
+- Sin límite de longitud: el buffer crece al doble mientras no llegue el
+  salto de línea.
+- Retorna: Puntero a la cadena leída (debe liberarse con free()), o NULL
+  en EOF para que main() termine ordenadamente.
+*/
+char *read_line(void)
+{
+    size_t bufsize = 1024, len = 0;
+    char *line = xmalloc(bufsize);
+    uint64_t t0 = probe_now();
+
+    // Leer entrada con fgets (o de la sesión grabada)
+    if (input_gets(line, bufsize) == NULL)
+    {
+        if (input_eof())
+        { // Caso: EOF (usuario termina la entrada)
+            if (interactive)
+                printf("\n");
+            free(line);
+            return NULL;
+        }
+        perror("fgets"); // Error de lectura
+        exit(EXIT_FAILURE);
+    }
+
+    // Línea más larga que el buffer: duplicarlo y seguir leyendo
+    len = strlen(line);
+    while (len == bufsize - 1 && line[len - 1] != '\n')
+    {
+        bufsize *= 2;
+        line = xrealloc(line, bufsize);
+        if (input_gets(line + len, bufsize - len) == NULL)
+            break; // EOF sin salto final: la línea ya está completa
+        len += strlen(line + len);
+    }
+    PROBE2(read_line, len, probe_now() - t0);
+    return line;
+}
+
+// ==================== split_line ====================
+/*
+Divide la línea en tokens (palabras) usando delimitadores.
+- Delimitadores: espacios, tabs, retornos de carro y saltos de línea.
+- Retorna: Array de punteros a tokens terminado en NULL (debe liberarse con free()).
+*/
+#define TOK_BUFSIZE 64      // Tamaño inicial del array de tokens
+#define TOK_DELIM " \t\r\n" // Caracteres delimitadores
+
+char **split_line(char *line)
+{
+    size_t bufsize = TOK_BUFSIZE;
+    size_t pos = 0;
+    char **tokens = xmalloc(bufsize * sizeof(char *));
+    uint64_t t0 = probe_now();
+
+    // Primer token usando strtok
+    char *tok = strtok(line, TOK_DELIM);
+
+    while (tok != NULL)
+    {
+        tokens[pos++] = tok;
+
+        // Redimensionar array si es necesario (al doble: coste lineal)
+        if (pos >= bufsize)
+        {
+            bufsize *= 2;
+            tokens = xrealloc(tokens, bufsize * sizeof(char *));
+        }
+
+        tok = strtok(NULL, TOK_DELIM); // Siguiente token
+    }
+
+    tokens[pos] = NULL; // Marca final del array
+    PROBE2(split_line, pos, probe_now() - t0);
+    return tokens;
+}
+
+// ==================== expansión de llaves ====================
+/*
+{a,b,c}, {N..M[..S]} (con relleno si algún extremo empieza por 0) y {a..e}.
+- brace_init()/brace_next() forman un generador perezoso: cada palabra se
+  construye al pedirla en un buffer propio, así un 'for' sobre {1..1000000}
+  usa memoria proporcional a la palabra, no al número de resultados.
+- Varios grupos en una palabra se combinan como un cuentakilómetros (el de
+  la derecha avanza primero): a{1,2}{x,y} → a1x a1y a2x a2y.
+- No hay llaves anidadas: un grupo que contiene '{' se copia literal.
+- brace_expand() materializa los resultados en argv para launch(),
+  respetando el límite EXPAND_MAX.
+*/
+struct brace_group
+{
+    const char *pre; // Texto literal antes del grupo
+    size_t pre_len;
+    const char *body; // Contenido de las llaves (lista separada por comas)
+    size_t body_len;
+    size_t item, item_len; // Elemento actual de la lista
+    int range;             // {N..M}: usa from/to/step/cur en lugar de la lista
+    int alpha;             // Rango de letras
+    int width;             // Ancho con ceros a la izquierda ({01..10})
+    long from, to, step, cur;
+};
+
+struct brace_gen
+{
+    struct brace_group *groups;
+    size_t ngroups;
+    const char *tail; // Literal tras el último grupo
+    struct strbuf out;
+    int state; // 0 = sin empezar, 1 = en curso, 2 = agotado
+};
+
+// Extremo de un rango: entero completo o una sola letra
+static int brace_bound(const char *s, size_t len, long *value, int *alpha, int *width)
+{
+    char num[32];
+    char *end;
+
+    if (len == 1 && isalpha((unsigned char)*s))
+    {
+        *value = (unsigned char)*s;
+        *alpha = 1;
+        return 1;
+    }
+    if (len == 0 || len >= sizeof(num))
+        return 0;
+    memcpy(num, s, len);
+    num[len] = '\0';
+    *value = strtol(num, &end, 10);
+    if (*end || !isdigit((unsigned char)num[len - 1]))
+        return 0;
+    if (num[*num == '-'] == '0' && len > (size_t)(1 + (*num == '-')))
+        *width = (int)len > *width ? (int)len : *width;
+    *alpha = 0;
+    return 1;
+}
+
+// Primer ".." en [s, end), o 'end' si no hay
+static const char *find_dots(const char *s, const char *end)
+{
+    for (; s + 1 < end; s++)
+    {
+        if (s[0] == '.' && s[1] == '.')
+            return s;
+    }
+    return end;
+}
+
+// Interpreta "N..M[..S]" o "a..e". Retorna: 1 si es un rango válido
+static int brace_range(struct brace_group *g)
+{
+    const char *a = g->body, *end = g->body + g->body_len;
+    const char *dots = find_dots(a, end);
+    int alpha_from, alpha_to, alpha_step = 0, width = 0;
+    long step = 1;
+
+    if (dots == end)
+        return 0;
+    const char *b = dots + 2;
+    const char *b_end = find_dots(b, end);
+
+    if (!brace_bound(a, dots - a, &g->from, &alpha_from, &width) ||
+        !brace_bound(b, b_end - b, &g->to, &alpha_to, &width) || alpha_from != alpha_to)
+        return 0;
+    if (b_end != end && (!brace_bound(b_end + 2, end - b_end - 2, &step, &alpha_step, &width) || alpha_step))
+        return 0;
+
+    step = step < 0 ? -step : step;
+    g->step = step ? step : 1;
+    g->alpha = alpha_from;
+    g->width = g->alpha ? 0 : width;
+    g->cur = g->from;
+    g->range = 1;
+    return 1;
+}
+
+// Longitud del elemento de la lista que empieza en 'item'
+static void brace_item(struct brace_group *g)
+{
+    const char *comma = memchr(g->body + g->item, ',', g->body_len - g->item);
+    size_t stop = comma ? (size_t)(comma - g->body) : g->body_len;
+    g->item_len = stop - g->item;
+}
+
+void brace_init(struct brace_gen *gen, const char *word)
+{
+    const char *p = word, *lit = word;
+    size_t cap = 0;
+
+    memset(gen, 0, sizeof(*gen));
+    // Una sola pasada: el grupo candidato empieza en la última '{' abierta
+    // (una '{' anterior sin cerrar es literal)
+    for (const char *open = NULL; *p; p++)
+    {
+        if (*p == '{')
+            open = p;
+        if (*p != '}' || !open)
+            continue;
+        const char *close = p;
+        p = open;
+        open = NULL;
+
+        struct brace_group g = {0};
+        g.pre = lit;
+        g.pre_len = p - lit;
+        g.body = p + 1;
+        g.body_len = close - p - 1;
+        if (!brace_range(&g))
+        {
+            if (!memchr(g.body, ',', g.body_len))
+            { // "{}" o "{x}": literal
+                p = close;
+                continue;
+            }
+            brace_item(&g);
+        }
+
+        if (gen->ngroups == cap)
+        {
+            cap = cap ? cap * 2 : 4;
+            gen->groups = xrealloc(gen->groups, cap * sizeof(*gen->groups));
+        }
+        gen->groups[gen->ngroups++] = g;
+        p = close;
+        lit = close + 1;
+    }
+    gen->tail = lit;
+}
+
+// Avanza el cuentakilómetros. Retorna: 0 cuando se agotan todas las combinaciones
+static int brace_advance(struct brace_gen *gen)
+{
+    for (size_t i = gen->ngroups; i-- > 0;)
+    {
+        struct brace_group *g = &gen->groups[i];
+        if (g->range)
+        {
+            // Distancias en unsigned: no desbordan aunque los extremos sean enormes
+            unsigned long left = g->to >= g->cur ? (unsigned long)g->to - (unsigned long)g->cur
+                                                 : (unsigned long)g->cur - (unsigned long)g->to;
+            if (left >= (unsigned long)g->step)
+            {
+                g->cur += g->to >= g->from ? g->step : -g->step;
+                return 1;
+            }
+            g->cur = g->from;
+        }
+        else
+        {
+            if (g->item + g->item_len < g->body_len)
+            {
+                g->item += g->item_len + 1;
+                brace_item(g);
+                return 1;
+            }
+            g->item = 0;
+            brace_item(g);
+        }
+    }
+    return 0;
+}
+
+// Retorna: La siguiente palabra (válida hasta la próxima llamada) o NULL al terminar
+const char *brace_next(struct brace_gen *gen)
+{
+    if (gen->state == 2 || (gen->state == 1 && !brace_advance(gen)))
+    {
+        gen->state = 2;
+        return NULL;
+    }
+    gen->state = 1;
+
+    gen->out.len = 0;
+    for (size_t i = 0; i < gen->ngroups; i++)
+    {
+        struct brace_group *g = &gen->groups[i];
+        sb_append(&gen->out, g->pre, g->pre_len);
+        if (!g->range)
+            sb_append(&gen->out, g->body + g->item, g->item_len);
+        else if (g->alpha)
+            sb_putc(&gen->out, (char)g->cur);
+        else
+        {
+            char num[32];
+            int n = snprintf(num, sizeof(num), "%0*ld", g->width, g->cur);
+            sb_append(&gen->out, num, n);
+        }
+    }
+    sb_append(&gen->out, gen->tail, strlen(gen->tail));
+    return gen->out.data;
+}
+
+void brace_free(struct brace_gen *gen)
+{
+    free(gen->groups);
+    free(gen->out.data);
+}
+
+/*
+Expande las llaves de cada argumento.
+- Retorna: 'args' tal cual si ninguno tiene '{'; si no, un nuevo array
+  (liberar con free(), junto con *words_out que guarda los textos), o NULL
+  si el resultado pasa de EXPAND_MAX bytes.
+*/
+char **brace_expand(char **args, char **words_out)
+{
+    struct strbuf arena = {0};
+    size_t *offs = NULL, count = 0, cap = 0;
+    int any = 0;
+
+    *words_out = NULL;
+    for (int i = 0; args[i] && !any; i++)
+        any = strchr(args[i], '{') != NULL;
+    if (!any)
+        return args;
+
+    for (int i = 0; args[i]; i++)
+    {
+        struct brace_gen gen;
+        const char *word;
+        brace_init(&gen, args[i]);
+        while ((word = brace_next(&gen)) != NULL)
+        {
+            if (count == cap)
+            {
+                cap = cap ? cap * 2 : 16;
+                offs = xrealloc(offs, cap * sizeof(*offs));
+            }
+            offs[count++] = arena.len;
+            sb_append(&arena, word, gen.out.len);
+            sb_putc(&arena, '\0');
+            if (arena.len > EXPAND_MAX)
+            {
+                fprintf(stderr, "shell: expansión de llaves demasiado grande (más de %d bytes)\n", EXPAND_MAX);
+                brace_free(&gen);
+                free(arena.data);
+                free(offs);
+                return NULL;
+            }
+        }
+        brace_free(&gen);
+    }
+
+    char **out = xmalloc((count + 1) * sizeof(char *));
+    for (size_t i = 0; i < count; i++)
+        out[i] = arena.data + offs[i];
+    out[count] = NULL;
+    free(offs);
+    *words_out = arena.data;
+    return out;
+}
+
+// ==================== aritmética ====================
+/*
+Expresiones enteras de ((...)) y for ((inicio; condición; paso)).
+- Se compilan una vez a bytecode de pila; las variables se resuelven a
+  "ranuras" int64_t al compilar, así el bucle no convierte a texto salvo al
+  publicar los valores antes de ejecutar el cuerpo.
+- Operadores: = += -= *= /= %=, ||, &&, == !=, < <= > >=, + -, * / %,
+  ! - + unarios, ++/-- prefijos y sufijos, paréntesis y ','. Un '$' ante
+  un nombre se ignora ($i == i).
+- Los nombres sin valor o no numéricos valen 0.
+*/
+enum arith_op
+{
+    OP_PUSH, // Constante 'arg'
+    OP_LOAD, // Ranura 'arg'
+    OP_STORE, // Cima → ranura 'arg' (la deja en la pila)
+    OP_POP,
+    OP_DUP,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_EQ,
+    OP_NE,
+    OP_NOT,
+    OP_NEG,
+    OP_BOOL, // Normaliza a 0/1
+    OP_JMP,  // Saltar a 'arg'
+    OP_JZ,   // Sacar y saltar si es 0
+    OP_JNZ,  // Sacar y saltar si no es 0
+    OP_YIELD, // Volver al llamador (ejecutar el cuerpo de un for)
+    OP_END,
+    // Superinstrucciones de los bucles (ver arith_fuse_step/arith_fuse_cond)
+    OP_ADDI, // ranura 'slot' += 'imm', sin tocar la pila
+    OP_JCMP  // Saltar a 'arg' si (ranura 'slot' <sub> 'imm')
+};
+
+struct arith_insn
+{
+    enum arith_op op;
+    enum arith_op sub; // Comparación de OP_JCMP
+    size_t slot;
+    int64_t arg;
+    int64_t imm;
+};
+
+#define ARITH_STACK 64 // Profundidad máxima de la pila de evaluación
+
+struct arith_prog
+{
+    struct arith_insn *code;
+    size_t len, cap;
+    char **names; // Nombre de cada ranura
+    unsigned char *written; // La ranura se asigna en algún punto
+    size_t nnames;
+    size_t depth, max_depth; // Profundidad de pila al compilar
+};
+
+#define ARITH_NEST 200 // Anidamiento máximo al compilar (recursión del parser)
+
+struct arith_parser
+{
+    const char *p, *end;
+    struct arith_prog *prog;
+    const char *error;
+    int nest;
+};
+
+static size_t arith_emit(struct arith_prog *prog, enum arith_op op, int64_t arg)
+{
+    if (prog->len == prog->cap)
+    {
+        prog->cap = prog->cap ? prog->cap * 2 : 32;
+        prog->code = xrealloc(prog->code, prog->cap * sizeof(*prog->code));
+    }
+    memset(&prog->code[prog->len], 0, sizeof(prog->code[0]));
+    prog->code[prog->len].op = op;
+    prog->code[prog->len].arg = arg;
+
+    // Seguir la profundidad para rechazar expresiones que desbordarían la pila
+    if (op == OP_PUSH || op == OP_LOAD || op == OP_DUP)
+        prog->depth++;
+    else if (op == OP_POP || op == OP_JZ || op == OP_JNZ || (op >= OP_ADD && op <= OP_NE))
+        prog->depth--;
+    if (prog->depth > prog->max_depth)
+        prog->max_depth = prog->depth;
+    return prog->len++;
+}
+
+static size_t arith_slot(struct arith_prog *prog, const char *name, size_t len)
+{
+    for (size_t i = 0; i < prog->nnames; i++)
+    {
+        if (strlen(prog->names[i]) == len && memcmp(prog->names[i], name, len) == 0)
+            return i;
+    }
+    prog->names = xrealloc(prog->names, (prog->nnames + 1) * sizeof(char *));
+    prog->written = xrealloc(prog->written, prog->nnames + 1);
+    prog->names[prog->nnames] = memcpy(xmalloc(len + 1), name, len);
+    prog->names[prog->nnames][len] = '\0';
+    prog->written[prog->nnames] = 0;
+    return prog->nnames++;
+}
+
+static void arith_skip(struct arith_parser *ps)
+{
+    while (ps->p < ps->end && isspace((unsigned char)*ps->p))
+        ps->p++;
+}
+
+// Consume el operador 'op' si viene a continuación (y no es parte de uno más largo)
+static int arith_accept(struct arith_parser *ps, const char *op)
+{
+    size_t len = strlen(op);
+    arith_skip(ps);
+    if ((size_t)(ps->end - ps->p) < len || memcmp(ps->p, op, len) != 0)
+        return 0;
+    if (len == 1 && ps->p + 1 < ps->end && ps->p[1] == '=' && strchr("=!<>+-*/%", *op))
+        return 0; // "<" no debe comerse "<="; "=" no debe comerse "=="
+    if (len == 1 && ps->p + 1 < ps->end && strchr("&|+-", *op) && ps->p[1] == *op)
+        return 0; // "+" frente a "++", "&" frente a "&&"
+    ps->p += len;
+    return 1;
+}
+
+// Nombre de variable (opcionalmente precedido de '$'). Retorna: su longitud o 0
+static size_t arith_name(struct arith_parser *ps, const char **name)
+{
+    const char *q;
+    arith_skip(ps);
+    q = ps->p + (ps->p < ps->end && *ps->p == '$');
+    if (q >= ps->end || (!isalpha((unsigned char)*q) && *q != '_'))
+        return 0;
+    *name = q;
+    while (q < ps->end && (isalnum((unsigned char)*q) || *q == '_'))
+        q++;
+    ps->p = q;
+    return q - *name;
+}
+
+static void arith_expr(struct arith_parser *ps);
+static void arith_assign(struct arith_parser *ps);
+
+static void arith_primary(struct arith_parser *ps)
+{
+    const char *name;
+    size_t len;
+
+    arith_skip(ps);
+    if (ps->p < ps->end && isdigit((unsigned char)*ps->p))
+    {
+        char *end;
+        int64_t v = strtoll(ps->p, &end, 0);
+        ps->p = end;
+        arith_emit(ps->prog, OP_PUSH, v);
+    }
+    else if (arith_accept(ps, "("))
+    {
+        arith_expr(ps);
+        if (!arith_accept(ps, ")"))
+            ps->error = "falta ')'";
+    }
+    else if ((len = arith_name(ps, &name)) != 0)
+    {
+        size_t slot = arith_slot(ps->prog, name, len);
+        arith_emit(ps->prog, OP_LOAD, slot);
+        if (arith_accept(ps, "++") || arith_accept(ps, "--"))
+        { // Sufijo: deja el valor anterior
+            ps->prog->written[slot] = 1;
+            arith_emit(ps->prog, OP_DUP, 0);
+            arith_emit(ps->prog, OP_PUSH, ps->p[-1] == '+' ? 1 : -1);
+            arith_emit(ps->prog, OP_ADD, 0);
+            arith_emit(ps->prog, OP_STORE, slot);
+            arith_emit(ps->prog, OP_POP, 0);
+        }
+    }
+    else
+        ps->error = "se esperaba un número o un nombre";
+}
+
+static void arith_unary(struct arith_parser *ps)
+{
+    if (++ps->nest > ARITH_NEST)
+        ps->error = "expresión demasiado anidada";
+    else if (arith_accept(ps, "++") || arith_accept(ps, "--"))
+    { // Prefijo: deja el valor nuevo
+        int64_t delta = ps->p[-1] == '+' ? 1 : -1;
+        const char *name;
+        size_t len = arith_name(ps, &name);
+        if (!len)
+        {
+            ps->error = "++/-- necesita un nombre";
+            return;
+        }
+        size_t slot = arith_slot(ps->prog, name, len);
+        ps->prog->written[slot] = 1;
+        arith_emit(ps->prog, OP_LOAD, slot);
+        arith_emit(ps->prog, OP_PUSH, delta);
+        arith_emit(ps->prog, OP_ADD, 0);
+        arith_emit(ps->prog, OP_STORE, slot);
+    }
+    else if (arith_accept(ps, "!"))
+    {
+        arith_unary(ps);
+        arith_emit(ps->prog, OP_NOT, 0);
+    }
+    else if (arith_accept(ps, "-"))
+    {
+        arith_unary(ps);
+        arith_emit(ps->prog, OP_NEG, 0);
+    }
+    else if (arith_accept(ps, "+"))
+        arith_unary(ps);
+    else
+        arith_primary(ps);
+    ps->nest--;
+}
+
+// Operadores binarios por niveles de precedencia (de menor a mayor)
+static const struct
+{
+    const char *text;
+    enum arith_op op;
+    int level;
+} arith_binops[] = {
+    {"==", OP_EQ, 0}, {"!=", OP_NE, 0},
+    {"<=", OP_LE, 1}, {">=", OP_GE, 1}, {"<", OP_LT, 1}, {">", OP_GT, 1},
+    {"+", OP_ADD, 2}, {"-", OP_SUB, 2},
+    {"*", OP_MUL, 3}, {"/", OP_DIV, 3}, {"%", OP_MOD, 3}};
+
+#define ARITH_LEVELS 4
+
+static void arith_binary(struct arith_parser *ps, int level)
+{
+    if (level == ARITH_LEVELS)
+    {
+        arith_unary(ps);
+        return;
+    }
+    arith_binary(ps, level + 1);
+    for (;;)
+    {
+        size_t i, n = sizeof(arith_binops) / sizeof(arith_binops[0]);
+        for (i = 0; i < n; i++)
+        {
+            if (arith_binops[i].level == level && arith_accept(ps, arith_binops[i].text))
+                break;
+        }
+        if (i == n || ps->error)
+            return;
+        arith_binary(ps, level + 1);
+        arith_emit(ps->prog, arith_binops[i].op, 0);
+    }
+}
+
+// a && b y a || b con cortocircuito
+static void arith_logic(struct arith_parser *ps, int is_or)
+{
+    if (is_or)
+        arith_logic(ps, 0);
+    else
+        arith_binary(ps, 0);
+
+    while (!ps->error && arith_accept(ps, is_or ? "||" : "&&"))
+    {
+        struct arith_prog *prog = ps->prog;
+        size_t jump = arith_emit(prog, is_or ? OP_JNZ : OP_JZ, 0);
+        if (is_or)
+            arith_logic(ps, 0);
+        else
+            arith_binary(ps, 0);
+        arith_emit(prog, OP_BOOL, 0);
+        size_t skip = arith_emit(prog, OP_JMP, 0);
+        prog->depth--; // Las dos ramas dejan un único valor
+        prog->code[jump].arg = prog->len;
+        arith_emit(prog, OP_PUSH, is_or);
+        prog->code[skip].arg = prog->len;
+    }
+}
+
+static void arith_assign(struct arith_parser *ps)
+{
+    static const char *ops[] = {"=", "+=", "-=", "*=", "/=", "%="};
+    static const enum arith_op binop[] = {OP_END, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD};
+    const char *save = ps->p, *name;
+    size_t len = arith_name(ps, &name);
+
+    if (len && ps->nest > ARITH_NEST)
+        ps->error = "expresión demasiado anidada";
+    else if (len)
+    {
+        for (int i = 0; i < 6; i++)
+        {
+            if (!arith_accept(ps, ops[i]))
+                continue;
+            size_t slot = arith_slot(ps->prog, name, len);
+            ps->prog->written[slot] = 1;
+            if (i)
+                arith_emit(ps->prog, OP_LOAD, slot);
+            ps->nest++;
+            arith_assign(ps);
+            ps->nest--;
+            if (i)
+                arith_emit(ps->prog, binop[i], 0);
+            arith_emit(ps->prog, OP_STORE, slot);
+            return;
+        }
+        ps->p = save; // No era una asignación: releer como expresión
+    }
+    arith_logic(ps, 1);
+}
+
+static void arith_expr(struct arith_parser *ps)
+{
+    arith_assign(ps);
+    while (!ps->error && arith_accept(ps, ","))
+    {
+        arith_emit(ps->prog, OP_POP, 0);
+        arith_assign(ps);
+    }
+}
+
+/*
+Compila 'src' (len bytes) y lo añade a 'prog'; una expresión vacía vale 1
+(así "for ((;;))" es un bucle infinito).
+- Retorna: 0 si todo fue bien, -1 con un mensaje en stderr si no.
+*/
+int arith_compile(struct arith_prog *prog, const char *src, size_t len)
+{
+    struct arith_parser ps = {src, src + len, prog, NULL, 0};
+
+    arith_skip(&ps);
+    if (ps.p == ps.end)
+    {
+        arith_emit(prog, OP_PUSH, 1);
+        return 0;
+    }
+    arith_expr(&ps);
+    arith_skip(&ps);
+    if (!ps.error && ps.p != ps.end)
+        ps.error = "texto sobrante";
+    if (!ps.error && prog->max_depth > ARITH_STACK)
+        ps.error = "expresión demasiado anidada";
+    if (ps.error)
+    {
+        fprintf(stderr, "shell: ((%.*s)): %s\n", (int)len, src, ps.error);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+Fusiona el paso de un bucle ya seguido de su OP_POP ("i++", "++i", "i += c",
+"i -= c") en un único OP_ADDI. 'start' es donde empieza su código.
+*/
+void arith_fuse_step(struct arith_prog *prog, size_t start)
+{
+    struct arith_insn *c = prog->code + start;
+    size_t n = prog->len - start;
+    int64_t delta;
+
+    if (n == 7 && c[0].op == OP_LOAD && c[1].op == OP_DUP && c[2].op == OP_PUSH &&
+        c[3].op == OP_ADD && c[4].op == OP_STORE && c[4].arg == c[0].arg)
+        delta = c[2].arg; // Sufijo: LOAD DUP PUSH ADD STORE POP POP
+    else if (n == 5 && c[0].op == OP_LOAD && c[1].op == OP_PUSH &&
+             (c[2].op == OP_ADD || c[2].op == OP_SUB) && c[3].op == OP_STORE && c[3].arg == c[0].arg)
+        delta = c[2].op == OP_ADD ? c[1].arg : (int64_t)-(uint64_t)c[1].arg; // LOAD PUSH ADD|SUB STORE POP
+    else
+        return;
+
+    c[0].slot = c[0].arg;
+    c[0].op = OP_ADDI;
+    c[0].imm = delta;
+    prog->len = start + 1;
+}
+
+/*
+Termina una condición de bucle saltando a 'target' si es cierta; "i < c" (y
+las demás comparaciones con una constante) se fusionan en un OP_JCMP.
+*/
+void arith_fuse_cond(struct arith_prog *prog, size_t start, size_t target)
+{
+    struct arith_insn *c = prog->code + start;
+
+    if (prog->len - start == 3 && c[0].op == OP_LOAD && c[1].op == OP_PUSH &&
+        c[2].op >= OP_LT && c[2].op <= OP_NE)
+    {
+        c[0].slot = c[0].arg;
+        c[0].sub = c[2].op;
+        c[0].imm = c[1].arg;
+        c[0].op = OP_JCMP;
+        c[0].arg = target;
+        prog->len = start + 1;
+        return;
+    }
+    arith_emit(prog, OP_JNZ, target);
+}
+
+void arith_free(struct arith_prog *prog)
+{
+    for (size_t i = 0; i < prog->nnames; i++)
+        free(prog->names[i]);
+    free(prog->names);
+    free(prog->written);
+    free(prog->code);
+}
+
+// Valor entero de una variable (0 si no existe o no es un número)
+static int64_t arith_value(const char *name)
+{
+    struct var *v = var_lookup(name, strlen(name));
+    int64_t value = 0;
+
+    if (v && v->has_int)
+        return v->ival;
+    if (!v)
+    {
+        const char *env = getenv(name);
+        return env && parse_int(env, strlen(env), &value) ? value : 0;
+    }
+    if (v->count && parse_int(v->items[0].ptr, v->items[0].len, &value))
+    { // Guardar la conversión: la próxima lectura no vuelve a analizar el texto
+        v->ival = value;
+        v->has_int = 1;
+    }
+    return value;
+}
+
+// Carga las ranuras desde las variables del shell
+void arith_load(const struct arith_prog *prog, int64_t *slots)
+{
+    for (size_t i = 0; i < prog->nnames; i++)
+        slots[i] = arith_value(prog->names[i]);
+}
+
+// Publica en las variables del shell las ranuras que el programa asigna (sin texto)
+void arith_store(const struct arith_prog *prog, const int64_t *slots)
+{
+    for (size_t i = 0; i < prog->nnames; i++)
+    {
+        if (prog->written[i])
+        {
+            var_set_int(prog->names[i], slots[i]);
+        }
+    }
+}
+
+/*
+Ejecuta desde *pc hasta OP_YIELD u OP_END.
+- Retorna: 1 en OP_YIELD (*pc queda tras él), 0 en OP_END (*result con la
+  cima de la pila), -1 en división por cero.
+*/
+int arith_run(const struct arith_prog *prog, int64_t *slots, size_t *pc, int64_t *result)
+{
+    int64_t stack[ARITH_STACK + 1];
+    size_t sp = 0;
+    const struct arith_insn *code = prog->code;
+
+    for (size_t i = *pc;; i++)
+    {
+        int64_t b;
+        switch (code[i].op)
+        {
+        case OP_PUSH:
+            stack[sp++] = code[i].arg;
+            break;
+        case OP_LOAD:
+            stack[sp++] = slots[code[i].arg];
+            break;
+        case OP_STORE:
+            slots[code[i].arg] = stack[sp - 1];
+            break;
+        case OP_POP:
+            sp--;
+            break;
+        case OP_DUP:
+            stack[sp] = stack[sp - 1];
+            sp++;
+            break;
+        case OP_NOT:
+            stack[sp - 1] = !stack[sp - 1];
+            break;
+        case OP_NEG:
+            stack[sp - 1] = -(uint64_t)stack[sp - 1];
+            break;
+        case OP_BOOL:
+            stack[sp - 1] = stack[sp - 1] != 0;
+            break;
+        case OP_JMP:
+            i = code[i].arg - 1;
+            break;
+        case OP_JZ:
+            if (stack[--sp] == 0)
+                i = code[i].arg - 1;
+            break;
+        case OP_JNZ:
+            if (stack[--sp] != 0)
+                i = code[i].arg - 1;
+            break;
+        case OP_ADDI:
+            slots[code[i].slot] = (int64_t)((uint64_t)slots[code[i].slot] + (uint64_t)code[i].imm);
+            break;
+        case OP_JCMP:
+        {
+            int64_t a = slots[code[i].slot], c = code[i].imm;
+            int taken;
+            switch (code[i].sub)
+            {
+            case OP_LT:
+                taken = a < c;
+                break;
+            case OP_LE:
+                taken = a <= c;
+                break;
+            case OP_GT:
+                taken = a > c;
+                break;
+            case OP_GE:
+                taken = a >= c;
+                break;
+            case OP_EQ:
+                taken = a == c;
+                break;
+            default:
+                taken = a != c;
+                break;
+            }
+            if (taken)
+                i = code[i].arg - 1;
+            break;
+        }
+        case OP_YIELD:
+            *pc = i + 1;
+            return 1;
+        case OP_END:
+            *result = sp ? stack[sp - 1] : 0;
+            return 0;
+        default: // Binarios
+            b = stack[--sp];
+            int64_t *a = &stack[sp - 1];
+            switch (code[i].op)
+            {
+            case OP_ADD:
+                *a = (int64_t)((uint64_t)*a + (uint64_t)b);
+                break;
+            case OP_SUB:
+                *a = (int64_t)((uint64_t)*a - (uint64_t)b);
+                break;
+            case OP_MUL:
+                *a = (int64_t)((uint64_t)*a * (uint64_t)b);
+                break;
+            case OP_DIV:
+            case OP_MOD:
+                if (b == 0 || (b == -1 && *a == INT64_MIN))
+                {
+                    fprintf(stderr, "shell: división por cero o desbordamiento\n");
+                    return -1;
+                }
+                *a = code[i].op == OP_DIV ? *a / b : *a % b;
+                break;
+            case OP_LT:
+                *a = *a < b;
+                break;
+            case OP_LE:
+                *a = *a <= b;
+                break;
+            case OP_GT:
+                *a = *a > b;
+                break;
+            case OP_GE:
+                *a = *a >= b;
+                break;
+            case OP_EQ:
+                *a = *a == b;
+                break;
+            case OP_NE:
+                *a = *a != b;
+                break;
+            default:
+                break;
+            }
+        }
+    }
+}
+
+/*
+Compila y evalúa EXPR publicando las variables que asigna.
+- Retorna: 0 con *result, -1 si hubo un error (ya informado).
+*/
+static int arith_eval(const char *src, size_t len, int64_t *result)
+{
+    struct arith_prog prog = {0};
+    int status = -1;
+
+    if (arith_compile(&prog, src, len) == 0)
+    {
+        int64_t *slots = xmalloc((prog.nnames ? prog.nnames : 1) * sizeof(int64_t));
+        size_t pc = 0;
+        arith_emit(&prog, OP_END, 0);
+        arith_load(&prog, slots);
+        status = arith_run(&prog, slots, &pc, result);
+        arith_store(&prog, slots);
+        free(slots);
+    }
+    arith_free(&prog);
+    return status;
+}
+
+// ==================== read_all ====================
+/*
+Lee un descriptor completo a un bloque del heap.
+- Lee en bloques de READ_BLOCK bytes duplicando el buffer cuando se llena.
+- Si es un archivo regular, reserva de entrada lo que queda por leer: una
+  sola reserva y, normalmente, un solo read().
+- Siempre queda al menos un byte libre tras los datos (para un '\0').
+- Retorna: El bloque (debe liberarse con free()) o NULL si hubo error.
+*/
+#define READ_BLOCK (64 * 1024) // Tamaño de cada read()
+
+char *read_all(int fd, size_t *len_out)
+{
+    size_t cap = READ_BLOCK, len = 0;
+#ifndef _WIN32
+    struct stat st;
+    off_t pos;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && (pos = lseek(fd, 0, SEEK_CUR)) >= 0 && st.st_size > pos)
+        cap = (size_t)(st.st_size - pos) + READ_BLOCK;
+#endif
+    char *buf = xmalloc(cap);
+
+    for (;;)
+    {
+        if (cap - len < READ_BLOCK)
+        {
+            cap *= 2;
+            buf = xrealloc(buf, cap);
+        }
+        ssize_t n = sh_read(fd, buf + len, cap - len - 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            perror("shell");
+            free(buf);
+            return NULL;
+        }
+        if (n == 0)
+            break;
+        len += n;
+    }
+
+    *len_out = len;
+    return buf;
+}
+
+// ==================== copy_fd ====================
+/*
+Copia todo el contenido de 'in' a 'out' sin pasar por buffers de usuario
+cuando el núcleo lo permite. Según el tipo de los descriptores (Linux):
+- archivo → archivo: copy_file_range() (puede usar reflinks del sistema
+  de archivos).
+- pipe en cualquiera de los extremos: splice().
+- archivo → otra cosa (socket, terminal, ...): sendfile().
+- Si nada de eso aplica, bucle read/write con un buffer de COPY_BLOCK.
+- Retorna: 0 si todo fue bien, -1 si hubo error (errno indica cuál).
+*/
+#ifdef __linux__
+#include <sys/sendfile.h> // sendfile
+#endif
+
+#define COPY_BLOCK (128 * 1024) // Buffer del bucle read/write
+#define COPY_CHUNK (1 << 30)    // Máximo por llamada a splice/sendfile/...
+
+static int write_all(int fd, const char *buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = sh_write(fd, buf, len);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return -1;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+#ifdef __linux__
+enum copy_method
+{
+    COPY_RANGE,
+    COPY_SPLICE,
+    COPY_SENDFILE
+};
+
+/*
+Bucle de copia con una llamada del núcleo.
+- Retorna: 0 al llegar a EOF, -1 si hubo error, 1 si el núcleo no soporta
+  esta combinación de descriptores (hay que usar read/write).
+*/
+static int copy_kernel(int in, int out, enum copy_method method)
+{
+    for (;;)
+    {
+        ssize_t n;
+        STAT_ADD(ST_KCOPIES, 1);
+        if (method == COPY_RANGE)
+            n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+        else if (method == COPY_SPLICE)
+            n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE | SPLICE_F_MORE);
+        else
+            n = sendfile(out, in, NULL, COPY_CHUNK);
+
+        if (n > 0)
+            continue;
+        if (n == 0)
+            return 0;
+        if (errno == EINTR)
+            continue;
+        if (errno == EINVAL || errno == ENOSYS || errno == EXDEV ||
+            errno == EBADF || errno == EOPNOTSUPP)
+            return 1; // Los offsets avanzan: read/write sigue desde aquí
+        return -1;
+    }
+}
+#endif
+
+int copy_fd(int in, int out)
+{
+#ifdef __linux__
+    struct stat ist, ost;
+    if (fstat(in, &ist) == 0 && fstat(out, &ost) == 0)
+    {
+        int rc = 1;
+        if (S_ISFIFO(ist.st_mode) || S_ISFIFO(ost.st_mode))
+            rc = copy_kernel(in, out, COPY_SPLICE);
+        else if (S_ISREG(ist.st_mode) && S_ISREG(ost.st_mode))
+            rc = copy_kernel(in, out, COPY_RANGE);
+        else if (S_ISREG(ist.st_mode))
+            rc = copy_kernel(in, out, COPY_SENDFILE);
+        if (rc <= 0)
+            return rc;
+    }
+#endif
+
+    char *buf = xmalloc(COPY_BLOCK);
+    for (;;)
+    {
+        ssize_t n = sh_read(in, buf, COPY_BLOCK);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0 || write_all(out, buf, n) != 0)
+        {
+            free(buf);
+            return n == 0 ? 0 : -1;
+        }
+    }
+}
+
+// ==================== salida ====================
+/*
+Buffer de salida de los builtins.
+- cur_out/cur_in son por hilo: en el hilo principal apuntan a los
+  descriptores 1 y 0; una etapa de tubería que corre en un hilo propio
+  (ver run_pipeline) tiene los suyos sin tocar la tabla de descriptores
+  del proceso.
+- out_flush() vacía el buffer del hilo actual (y stdio en el principal);
+  debe llamarse antes de cualquier dup2 sobre el descriptor 1 o fork.
+*/
+#define OUT_BUFSIZE 8192
+
+struct outbuf
+{
+    int fd;
+    size_t len;
+    char data[OUT_BUFSIZE];
+};
+
+static struct outbuf main_out = {1, 0, {0}};
+static _Thread_local struct outbuf *cur_out = &main_out;
+static _Thread_local int cur_in = 0;
+
+void out_flush(void)
+{
+    if (cur_out == &main_out)
+        fflush(stdout);
+    if (cur_out->len > 0)
+        write_all(cur_out->fd, cur_out->data, cur_out->len);
+    cur_out->len = 0;
+}
+
+void out_write(const char *s, size_t len)
+{
+    if (cur_out->len + len > OUT_BUFSIZE)
+    {
+        out_flush();
+        if (len > OUT_BUFSIZE)
+        {
+            write_all(cur_out->fd, s, len);
+            return;
+        }
+    }
+    memcpy(cur_out->data + cur_out->len, s, len);
+    cur_out->len += len;
+}
+
+void out_printf(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = OUT_BUFSIZE - cur_out->len;
+    int n = vsnprintf(cur_out->data + cur_out->len, room, fmt, ap);
+    va_end(ap);
+
+    if (n >= 0 && (size_t)n < room)
+    {
+        cur_out->len += n;
+        return;
+    }
+    if (n < 0)
+        return;
+
+    // No cabía: formatear aparte y escribir
+    char *tmp = xmalloc(n + 1);
+    va_start(ap, fmt);
+    vsnprintf(tmp, n + 1, fmt, ap);
+    va_end(ap);
+    out_write(tmp, n);
+    free(tmp);
+}
+
+// ==================== E/S por lotes ====================
+/*
+Aperturas y stats en lote para los builtins que tocan muchos archivos
+(cat con varios archivos, las pruebas de archivo de test/[[).
+- Linux: las operaciones se encolan en un io_uring y se envían con una sola
+  llamada a io_uring_enter; el anillo se crea la primera vez y se reusa.
+- Sin io_uring (núcleo antiguo, deshabilitado por sysctl o seccomp, otro
+  sistema, o el anillo ocupado por otro hilo) cada operación es la llamada
+  síncrona de siempre, con el mismo resultado.
+- io_batch_run() deja en res el descriptor (apertura), 0 (stat) o -errno.
+*/
+#define IO_BATCH 64 // Entradas del anillo (operaciones por envío)
+
+#if defined(__linux__) && defined(STATX_TYPE)
+typedef struct statx io_statbuf;
+#else
+typedef struct stat io_statbuf;
+#endif
+
+enum io_kind
+{
+    IO_OPEN,
+    IO_STAT
+};
+
+struct io_op
+{
+    int kind;
+    const char *path;
+    int flags;       // IO_OPEN: O_*; IO_STAT: AT_SYMLINK_NOFOLLOW o 0
+    unsigned mask;   // IO_STAT: STATX_* pedidos (solo Linux)
+    io_statbuf *buf; // IO_STAT: destino
+    int res;
+};
+
+#ifndef AT_SYMLINK_NOFOLLOW
+#define AT_SYMLINK_NOFOLLOW 0x100 // Windows: sin enlaces, io_sync lo ignora
+#endif
+
+static int io_sync(struct io_op *op)
+{
+    int r;
+    if (op->kind == IO_OPEN)
+        r = open(op->path, op->flags, 0666);
+#if defined(__linux__) && defined(STATX_TYPE)
+    else
+        r = statx(AT_FDCWD, op->path, op->flags, op->mask, op->buf);
+#elif defined(_WIN32)
+    else
+        r = stat(op->path, op->buf);
+#else
+    else
+        r = op->flags & AT_SYMLINK_NOFOLLOW ? lstat(op->path, op->buf) : stat(op->path, op->buf);
+#endif
+    return r < 0 ? -errno : r;
+}
+
+#if defined(__linux__) && defined(STATX_TYPE) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h> // Estructuras y constantes del anillo (sin liburing)
+#include <sys/syscall.h>    // __NR_io_uring_setup, __NR_io_uring_enter
+#define HAVE_IO_URING 1
+
+struct io_ring
+{
+    int fd;    // -1 = sin anillo
+    pid_t pid; // Proceso que lo creó: un hijo tras fork crea el suyo
+    unsigned entries;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_len, cq_len;
+    int unsupported; // El núcleo rechazó OPENAT/STATX (anterior a 5.6)
+};
+
+static struct io_ring ring = {.fd = -1};
+static int ring_tried;
+static pthread_mutex_t ring_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void io_ring_close(void)
+{
+    if (ring.sqes)
+        munmap(ring.sqes, ring.entries * sizeof(struct io_uring_sqe));
+    if (ring.cq_map && ring.cq_map != ring.sq_map)
+        munmap(ring.cq_map, ring.cq_len);
+    if (ring.sq_map)
+        munmap(ring.sq_map, ring.sq_len);
+    if (ring.fd >= 0)
+        close(ring.fd);
+    memset(&ring, 0, sizeof(ring));
+    ring.fd = -1;
+}
+
+// Retorna: 0 si el anillo está listo
+static int io_ring_open(void)
+{
+    if (ring_tried && ring.pid != getpid())
+    { // Heredado por fork: las páginas son compartidas con el padre
+        io_ring_close();
+        ring_tried = 0;
+    }
+    if (ring_tried)
+        return ring.fd >= 0 && !ring.unsupported ? 0 : -1;
+    ring_tried = 1;
+    ring.pid = getpid();
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, IO_BATCH, &p);
+    if (ring.fd < 0)
+        return -1;
+    ring.entries = p.sq_entries;
+    ring.sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.sq_len = ring.cq_len = ring.sq_len > ring.cq_len ? ring.sq_len : ring.cq_len;
+
+    void *sq = mmap(NULL, ring.sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    ring.sq_map = sq == MAP_FAILED ? NULL : sq;
+    if (!ring.sq_map)
+        goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+        ring.cq_map = ring.sq_map;
+    else
+    {
+        void *cq = mmap(NULL, ring.cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+        ring.cq_map = cq == MAP_FAILED ? NULL : cq;
+        if (!ring.cq_map)
+            goto fail;
+    }
+    void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    ring.sqes = sqes == MAP_FAILED ? NULL : sqes;
+    if (!ring.sqes)
+        goto fail;
+
+    char *sqm = ring.sq_map, *cqm = ring.cq_map;
+    ring.sq_tail = (unsigned *)(sqm + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sqm + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sqm + p.sq_off.array);
+    ring.cq_head = (unsigned *)(cqm + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(cqm + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(cqm + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(cqm + p.cq_off.cqes);
+    return 0;
+
+fail:
+    io_ring_close();
+    ring.pid = getpid();
+    return -1;
+}
+
+// Envía ops[0..n) (n <= entries) y espera todas las respuestas
+static int io_ring_submit(struct io_op *ops, unsigned n)
+{
+    unsigned tail = *ring.sq_tail;
+    for (unsigned i = 0; i < n; i++, tail++)
+    {
+        unsigned idx = tail & *ring.sq_mask;
+        struct io_uring_sqe *sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)ops[i].path;
+        if (ops[i].kind == IO_OPEN)
+        {
+            sqe->opcode = IORING_OP_OPENAT;
+            sqe->len = 0666;
+            sqe->open_flags = ops[i].flags;
+        }
+        else
+        {
+            sqe->opcode = IORING_OP_STATX;
+            sqe->len = ops[i].mask;
+            sqe->off = (uintptr_t)ops[i].buf;
+            sqe->statx_flags = ops[i].flags;
+        }
+        sqe->user_data = i;
+        ring.sq_array[idx] = idx;
+    }
+    __atomic_store_n(ring.sq_tail, tail, __ATOMIC_RELEASE);
+
+    unsigned submitted = 0, done = 0;
+    while (done < n)
+    {
+        int r = syscall(__NR_io_uring_enter, ring.fd, n - submitted, n - done, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+            return -1; // El llamador descarta el anillo
+        if (r > 0)
+            submitted += r;
+
+        unsigned head = *ring.cq_head;
+        unsigned ctail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; head++, done++)
+        {
+            struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+            ops[cqe->user_data].res = cqe->res;
+        }
+        __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+#endif
+
+// Suelta el anillo (p. ej. antes de cerrar descriptores en masa)
+void io_reset(void)
+{
+#ifdef HAVE_IO_URING
+    io_ring_close();
+    ring_tried = 0;
+#endif
+}
+
+/*
+Ejecuta las operaciones (todas del mismo tipo); cada ops[i].res queda como
+el retorno de la llamada síncrona equivalente (o -errno).
+- Con una sola operación no compensa el anillo: va directa.
+- Se mide el coste por operación de cada camino y se usa el más barato:
+  con metadatos en caché y pocas CPU el anillo puede perder (io_uring
+  manda statx siempre a sus hilos de trabajo); con disco frío o sistemas
+  de archivos de red gana. Cada IO_PROBE lotes se vuelve a probar el otro.
+*/
+#define IO_PROBE 32
+
+static uint64_t io_cost[2][2]; // [tipo][0 = síncrono, 1 = anillo]: ns por operación, 0 = sin medir
+static unsigned io_batches;
+
+static uint64_t io_now_ns(void)
+{
+    struct timespec ts;
+    timespec_get(&ts, TIME_UTC);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+void io_batch_run(struct io_op *ops, int n)
+{
+    int i = 0;
+    if (n <= 0)
+        return;
+#ifdef HAVE_IO_URING
+    uint64_t *cost = io_cost[ops[0].kind];
+    uint64_t sync_ns = __atomic_load_n(&cost[0], __ATOMIC_RELAXED);
+    uint64_t ring_ns = __atomic_load_n(&cost[1], __ATOMIC_RELAXED);
+    int probe = __atomic_add_fetch(&io_batches, 1, __ATOMIC_RELAXED) % IO_PROBE == 0;
+    int ring_first = ring_ns && sync_ns ? ring_ns < sync_ns : !ring_ns; // Sin medir: probar el anillo
+    uint64_t t0 = io_now_ns();
+    int used_ring = 0;
+
+    if (n > 1 && ring_first != probe && pthread_mutex_trylock(&ring_lock) == 0)
+    {
+        while (i < n && io_ring_open() == 0)
+        {
+            unsigned chunk = (unsigned)(n - i) < ring.entries ? (unsigned)(n - i) : ring.entries;
+            if (io_ring_submit(ops + i, chunk) != 0)
+            {
+                io_ring_close(); // Algo raro en el anillo: seguir sin él
+                ring.pid = getpid();
+                break;
+            }
+            for (unsigned k = 0; k < chunk; k++)
+            {
+                if (ops[i + k].res == -EINVAL && (ops[i + k].res = io_sync(&ops[i + k])) != -EINVAL)
+                    ring.unsupported = 1; // Operación desconocida para este núcleo
+            }
+            STAT_ADD(ST_RING_OPS, chunk);
+            i += chunk;
+        }
+        pthread_mutex_unlock(&ring_lock);
+        used_ring = i == n;
+    }
+#endif
+    for (; i < n; i++)
+        ops[i].res = io_sync(&ops[i]);
+#ifdef HAVE_IO_URING
+    if (n > 1)
+    { // Media móvil del coste por operación del camino usado
+        uint64_t *c = &cost[used_ring];
+        uint64_t per_op = (io_now_ns() - t0) / n + 1;
+        uint64_t old = __atomic_load_n(c, __ATOMIC_RELAXED);
+        __atomic_store_n(c, old ? (3 * old + per_op) / 4 : per_op, __ATOMIC_RELAXED);
+    }
+#endif
+}
+
+// ==================== caché de stat ====================
+/*
+Resultados de stat/access de las pruebas de archivo (test, [ y [[).
+- Vale durante un comando compuesto (una línea de run_line): en
+  "[ -f x ] && [ -r x ] && [ -s x ]" solo el primero llega al kernel.
+- stat_cache_clear() tras una redirección de escritura (la misma ruta
+  puede estar escrita de otra forma: "e.txt" y "./e.txt"), un comando
+  externo, un builtin BI_FS o al terminar la línea.
+- En Linux se usa statx pidiendo solo los campos necesarios (tipo, tamaño,
+  mtime, inodo); si otra prueba necesita más, se repite con la unión.
+*/
+#define STAT_CACHE 16 // Rutas recordadas (reemplazo circular)
+
+enum
+{
+    SF_TYPE = 1,  // Existencia y tipo
+    SF_SIZE = 2,
+    SF_MTIME = 4,
+    SF_INO = 8    // Dispositivo e inodo (-ef)
+};
+
+struct stat_entry
+{
+    char *path; // NULL = libre
+    int nofollow; // lstat (-L/-h)
+    unsigned fields; // SF_* ya obtenidos
+    int err;         // errno del último intento (0 = existe)
+    unsigned mode;
+    uint64_t size;
+    int64_t mtime_sec;
+    long mtime_nsec;
+    uint64_t dev, ino;
+    unsigned access_known, access_ok; // Bits R_OK/W_OK/X_OK ya consultados
+};
+
+#ifdef _WIN32
+#define R_OK 4
+#define W_OK 2
+#define X_OK 1 // Sin permiso de ejecución en Windows: basta con que exista
+#endif
+
+static struct stat_entry stat_cache[STAT_CACHE];
+static int stat_next = 0;
+
+void stat_cache_clear(void)
+{
+    for (int i = 0; i < STAT_CACHE; i++)
+    {
+        free(stat_cache[i].path);
+        stat_cache[i].path = NULL;
+    }
+}
+
+// Campos de statx que hacen falta para 'fields' (SF_*)
+static unsigned stat_mask(unsigned fields)
+{
+#if defined(__linux__) && defined(STATX_TYPE)
+    unsigned mask = STATX_TYPE | STATX_MODE;
+    if (fields & SF_SIZE)
+        mask |= STATX_SIZE;
+    if (fields & SF_MTIME)
+        mask |= STATX_MTIME;
+    if (fields & SF_INO)
+        mask |= STATX_INO;
+    return mask;
+#else
+    (void)fields;
+    return 0;
+#endif
+}
+
+// Guarda en la entrada el resultado (res de io_op) de un stat
+static void stat_store(struct stat_entry *e, unsigned fields, int res, const io_statbuf *b)
+{
+    e->fields = fields;
+    e->err = res < 0 ? -res : 0;
+    if (res < 0)
+        return;
+#if defined(__linux__) && defined(STATX_TYPE)
+    e->mode = b->stx_mode;
+    e->size = b->stx_size;
+    e->mtime_sec = b->stx_mtime.tv_sec;
+    e->mtime_nsec = b->stx_mtime.tv_nsec;
+    e->dev = ((uint64_t)b->stx_dev_major << 32) | b->stx_dev_minor;
+    e->ino = b->stx_ino;
+#else
+    e->mode = b->st_mode;
+    e->size = b->st_size;
+    e->mtime_sec = b->st_mtime;
+    e->mtime_nsec = 0;
+    e->dev = b->st_dev;
+    e->ino = b->st_ino;
+#endif
+}
+
+// Rellena 'fields' de la entrada con una sola llamada al sistema
+static void stat_fill(struct stat_entry *e, unsigned fields)
+{
+    io_statbuf b;
+    struct io_op op = {IO_STAT, e->path, e->nofollow ? AT_SYMLINK_NOFOLLOW : 0, stat_mask(fields), &b, 0};
+    stat_store(e, fields, io_sync(&op), &b);
+}
+
+static struct stat_entry *stat_find(const char *path, int nofollow)
+{
+    for (int i = 0; i < STAT_CACHE; i++)
+    {
+        if (stat_cache[i].path && stat_cache[i].nofollow == nofollow && strcmp(stat_cache[i].path, path) == 0)
+            return &stat_cache[i];
+    }
+    return NULL;
+}
+
+// Entrada de 'path' (nueva y vacía si no estaba)
+static struct stat_entry *stat_slot(const char *path, int nofollow)
+{
+    struct stat_entry *e = stat_find(path, nofollow);
+    if (e)
+        return e;
+    e = &stat_cache[stat_next];
+    stat_next = (stat_next + 1) % STAT_CACHE;
+    free(e->path);
+    memset(e, 0, sizeof(*e));
+    e->path = xstrdup(path);
+    e->nofollow = nofollow;
+    return e;
+}
+
+/*
+Datos de 'path' con al menos 'fields'.
+- Retorna: La entrada de la caché; e->err != 0 si el archivo no existe.
+*/
+static struct stat_entry *stat_cached(const char *path, int nofollow, unsigned fields)
+{
+    struct stat_entry *e = stat_slot(path, nofollow);
+    if ((e->fields & fields) != fields && !(e->fields && e->err))
+        stat_fill(e, e->fields | fields); // Un archivo que no existe no necesita más campos
+    return e;
+}
+
+struct stat_want
+{
+    const char *path;
+    int nofollow;
+    unsigned fields;
+};
+
+/*
+Carga en la caché varias rutas con un solo envío de io_batch_run().
+- Las que ya tienen los campos pedidos no se repiten.
+- Como mucho STAT_CACHE / 2 rutas, y se corta antes de que una entrada
+  nueva desplace a otra del mismo lote.
+*/
+void stat_prefetch(const struct stat_want *want, int n)
+{
+    struct stat_entry *ents[STAT_CACHE / 2];
+    unsigned fields[STAT_CACHE / 2];
+    int m = 0;
+
+    for (int i = 0; i < n && m < STAT_CACHE / 2; i++)
+    {
+        struct stat_entry *e = stat_find(want[i].path, want[i].nofollow);
+        if (!e)
+        {
+            int k = 0;
+            while (k < m && ents[k] != &stat_cache[stat_next])
+                k++;
+            if (k < m)
+                break; // La entrada nueva desplazaría a una del lote
+            e = stat_slot(want[i].path, want[i].nofollow);
+        }
+        if ((e->fields & want[i].fields) == want[i].fields || (e->fields && e->err))
+            continue;
+        int k = 0;
+        while (k < m && ents[k] != e)
+            k++;
+        if (k == m)
+        {
+            ents[m] = e;
+            fields[m++] = e->fields;
+        }
+        fields[k] |= want[i].fields;
+    }
+    if (m < 2)
+        return; // Una sola ruta: stat_cached la pedirá cuando haga falta
+
+    struct io_op ops[STAT_CACHE / 2];
+    io_statbuf bufs[STAT_CACHE / 2];
+    for (int k = 0; k < m; k++)
+    {
+        ops[k].kind = IO_STAT;
+        ops[k].path = ents[k]->path;
+        ops[k].flags = ents[k]->nofollow ? AT_SYMLINK_NOFOLLOW : 0;
+        ops[k].mask = stat_mask(fields[k]);
+        ops[k].buf = &bufs[k];
+    }
+    io_batch_run(ops, m);
+    for (int k = 0; k < m; k++)
+        stat_store(ents[k], fields[k], ops[k].res, &bufs[k]);
+}
+
+// access() memorizado. Retorna: 1 si se permite 'mode' (R_OK, W_OK o X_OK)
+static int access_cached(const char *path, unsigned mode)
+{
+    struct stat_entry *e = stat_cached(path, 0, SF_TYPE);
+    if (e->err)
+        return 0;
+    if (!(e->access_known & mode))
+    {
+        e->access_known |= mode;
+#ifdef _WIN32
+        if (_access(path, mode == X_OK ? 0 : (int)mode) == 0)
+#else
+        if (access(path, mode) == 0)
+#endif
+            e->access_ok |= mode;
+    }
+    return (e->access_ok & mode) != 0;
+}
+
+// ==================== redirecciones ====================
+/*
+Aplica las redirecciones '<', '>', '>>', '>&N' y '<&N' de la línea de comandos.
+- Acepta el archivo separado ("< in.txt") o pegado ("<in.txt") y un número
+  de descriptor opcional delante ("2>err.txt", "2>&1").
+- Quita los tokens de redirección de args y guarda los descriptores
+  originales para restaurarlos con restore_redirects().
+- Retorna: 0 si todo fue bien, -1 si no se pudo abrir algún archivo.
+*/
+struct redir_save
+{
+    int saved[3]; // Copia de stdin/stdout/stderr originales (-1 = sin tocar)
+};
+
+static int stdin_redirected = 0; // El builtin read no debe usar el buffer de stdin
+
+// Sustituye 'target' por 'fd' guardando antes el original
+static int redirect_to(struct redir_save *save, int target, int fd)
+{
+    if (target == 1)
+        out_flush();
+    if (save->saved[target] < 0)
+    {
+#ifdef _WIN32
+        save->saved[target] = dup(target);
+#else
+        save->saved[target] = fcntl(target, F_DUPFD_CLOEXEC, 10);
+#endif
+    }
+    if (dup2(fd, target) < 0)
+        return -1;
+    if (target == 0)
+        stdin_redirected = 1;
+    return 0;
+}
+
+/*
+Descriptores de '>>' reutilizados dentro de un comando compuesto: en
+"for f in ...; do echo $f >> out.log; done" el archivo se abre una vez.
+- Antes de reutilizarlo, un stat de la ruta comprueba que sigue siendo el
+  mismo archivo (dispositivo e inodo); si lo renombraron, lo borraron o la
+  ruta ya es otra (tras un cd), se cierra y se vuelve a abrir.
+- Con O_APPEND cada escritura va al final aunque otro proceso escriba o
+  trunque el archivo entre vueltas.
+- append_cache_clear() los cierra al terminar la línea (run_line).
+*/
+#ifndef _WIN32
+#define APPEND_CACHE 8 // Rutas abiertas a la vez (reemplazo circular)
+
+struct append_entry
+{
+    char *path; // NULL = libre
+    int fd;     // >= 10, O_CLOEXEC: no choca con 0-2 ni llega a los hijos
+    dev_t dev;
+    ino_t ino;
+};
+
+static struct append_entry append_cache[APPEND_CACHE];
+static int append_next = 0;
+
+static void append_drop(struct append_entry *e)
+{
+    close(e->fd);
+    free(e->path);
+    e->path = NULL;
+}
+
+// Descriptor de 'path' para '>>'. Retorna: fd de la caché (no cerrarlo) o -1
+static int append_open(const char *path)
+{
+    struct append_entry *e = NULL;
+    struct stat st;
+
+    for (int i = 0; i < APPEND_CACHE && !e; i++)
+    {
+        if (append_cache[i].path && strcmp(append_cache[i].path, path) == 0)
+            e = &append_cache[i];
+    }
+    if (e)
+    {
+        if (stat(path, &st) == 0 && st.st_dev == e->dev && st.st_ino == e->ino)
+            return e->fd;
+        append_drop(e); // Renombrado, borrado u otro archivo
+    }
+    else
+    {
+        e = &append_cache[append_next];
+        append_next = (append_next + 1) % APPEND_CACHE;
+        if (e->path)
+            append_drop(e);
+    }
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd >= 0 && fd < 10)
+    {
+        int high = fcntl(fd, F_DUPFD_CLOEXEC, 10);
+        close(fd);
+        fd = high;
+    }
+    if (fd < 0 || fstat(fd, &st) != 0)
+    {
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+    e->path = xstrdup(path);
+    e->fd = fd;
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    return fd;
+}
+#endif
+
+void append_cache_clear(void)
+{
+#ifndef _WIN32
+    for (int i = 0; i < APPEND_CACHE; i++)
+    {
+        if (append_cache[i].path)
+            append_drop(&append_cache[i]);
+    }
+#endif
+}
+
+static int redirect_fd(struct redir_save *save, int target, const char *path, int flags)
+{
+#ifdef _WIN32
+    int cached = 0;
+    int fd = open(path, flags, 0644);
+#else
+    int cached = flags == (O_WRONLY | O_CREAT | O_APPEND);
+    int fd = cached ? append_open(path) : open(path, flags, 0644);
+#endif
+    if (fd < 0)
+    {
+        fprintf(stderr, "shell: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+
+    if (flags != O_RDONLY)
+        stat_cache_clear(); // Tamaño y mtime cambian, o el archivo pasa a existir
+    redirect_to(save, target, fd);
+    if (!cached)
+        close(fd);
+    return 0; // dup2 sobre 0-2 con un fd recién abierto no falla
+}
+
+/*
+Reconoce un token de redirección sin tocar ningún descriptor.
+- Rellena el descriptor destino y los flags de open().
+- Retorna: Lo que sigue al operador ("" si el archivo va en el token
+  siguiente, "&N" para duplicar) o NULL si no es una redirección.
+*/
+static const char *parse_redirect(const char *tok, int *target, int *flags)
+{
+    *target = -1;
+    if (tok[0] >= '0' && tok[0] <= '2' && (tok[1] == '<' || tok[1] == '>'))
+        *target = *tok++ - '0';
+
+    if (strncmp(tok, ">>", 2) == 0)
+    {
+        *target = *target < 0 ? 1 : *target;
+        *flags = O_WRONLY | O_CREAT | O_APPEND;
+        return tok + 2;
+    }
+    if (*tok == '>')
+    {
+        *target = *target < 0 ? 1 : *target;
+        *flags = O_WRONLY | O_CREAT | O_TRUNC;
+        return tok + 1;
+    }
+    if (*tok == '<')
+    {
+        *target = *target < 0 ? 0 : *target;
+        *flags = O_RDONLY;
+        return tok + 1;
+    }
+    return NULL;
+}
+
+int apply_redirects(char **args, struct redir_save *save)
+{
+    int out = 0;
+
+    for (int i = 0; i < 3; i++)
+        save->saved[i] = -1;
+
+    for (int i = 0; args[i]; i++)
+    {
+        int target, flags;
+        const char *tok = parse_redirect(args[i], &target, &flags);
+
+        if (!tok)
+        {
+            args[out++] = args[i]; // Argumento normal
+            continue;
+        }
+
+        if (*tok == '&')
+        { // Duplicar un descriptor ya abierto: ">&N"
+            char *end;
+            long fd = strtol(tok + 1, &end, 10);
+            if (end == tok + 1 || *end || fd < 0 || redirect_to(save, target, (int)fd) != 0)
+            {
+                fprintf(stderr, "shell: %s: descriptor inválido\n", tok + 1);
+                args[out] = NULL;
+                return -1;
+            }
+            continue;
+        }
+
+        if (!*tok)
+            tok = args[++i]; // Archivo en el token siguiente
+        if (!tok)
+        {
+            fprintf(stderr, "shell: falta el archivo de la redirección\n");
+            args[out] = NULL;
+            return -1;
+        }
+        if (redirect_fd(save, target, tok, flags) != 0)
+        {
+            args[out] = NULL;
+            return -1;
+        }
+    }
+
+    args[out] = NULL;
+    return 0;
+}
+
+void restore_redirects(struct redir_save *save)
+{
+    out_flush();
+    for (int i = 0; i < 3; i++)
+    {
+        if (save->saved[i] >= 0)
+        {
+            dup2(save->saved[i], i);
+            close(save->saved[i]);
+        }
+    }
+    stdin_redirected = 0;
+}
+
+// ==================== trabajos ====================
+/*
+Procesos hijos que siguen vivos tras volver al prompt (coprocesos, ...).
+- service_events() se llama en cada vuelta del bucle principal y recoge
+  sin bloquear los que hayan terminado, para no dejar zombis.
+- Quien espere hijos con wait() genérico debe avisar con jobs_note_exit()
+  si recoge uno que no es suyo.
+*/
+#ifndef _WIN32
+struct job
+{
+    pid_t pid;
+    struct job *next;
+};
+
+static struct job *jobs = NULL;
+
+void jobs_add(pid_t pid)
+{
+    struct job *j = xmalloc(sizeof(*j));
+    j->pid = pid;
+    j->next = jobs;
+    jobs = j;
+}
+
+// Quita el trabajo 'pid' de la tabla. Retorna: 1 si era un trabajo
+int jobs_note_exit(pid_t pid)
+{
+    for (struct job **pp = &jobs; *pp; pp = &(*pp)->next)
+    {
+        if ((*pp)->pid == pid)
+        {
+            struct job *j = *pp;
+            *pp = j->next;
+            free(j);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+void zygote_refresh(void);
+
+void service_events(void)
+{
+    pid_t pid;
+    while (jobs && (pid = waitpid(-1, NULL, WNOHANG)) > 0)
+        jobs_note_exit(pid);
+    zygote_refresh();
+}
+#else
+void service_events(void)
+{
+}
+#endif
+
+// ==================== zygote ====================
+/*
+Servidor de fork opcional (--zygote) para los subshells de <(...) y >(...).
+- Al arrancar (tras --load-state) se crea un proceso pequeño y "caliente"
+  que solo espera peticiones por un socket; cada petición (directorio
+  actual + texto del comando + descriptores 0/1/2 vía SCM_RIGHTS) se
+  atiende con un fork del zygote, no del shell principal, cuyo RSS crece.
+- El zygote guarda el estado del momento en que se creó. Si el shell
+  modifica variables después (state_gen), el subshell se crea con fork
+  directo y service_events() renueva el zygote entre comandos (solo si
+  hizo falta, para no pagar un fork por cada asignación).
+*/
+#ifndef _WIN32
+#include <sys/socket.h> // socketpair, sendmsg, SCM_RIGHTS
+#ifdef __linux__
+#include <sys/syscall.h> // SYS_close_range
+#endif
+
+#define ZYGOTE_MSG_MAX (64 * 1024) // Petición más grande que se envía al zygote
+
+static int run_line(const char *line);
+void jobs_add(pid_t pid);
+void coproc_forget_all(void);
+void io_reset(void);
+
+static int zygote_fd = -1;        // Socket hacia el zygote (-1 = desactivado)
+static pid_t zygote_pid = -1;
+static unsigned long zygote_gen;  // state_gen en el momento del fork
+static int zygote_enabled = 0;
+static int zygote_missed = 0;     // Hubo una petición con el zygote desfasado
+
+/*
+Cierra todos los descriptores salvo 0-2 y 'keep'.
+- El zygote no hace exec, así que O_CLOEXEC no le quita nada: sin esto se
+  quedaría con los extremos de los coprocesos (y coproc -c no podría
+  mandar EOF) o con cualquier archivo abierto por el shell al crearlo.
+*/
+static void close_fds_except(int keep)
+{
+#if defined(__linux__) && defined(SYS_close_range)
+    if (syscall(SYS_close_range, 3, keep - 1, 0) == 0 &&
+        syscall(SYS_close_range, keep + 1, ~0U, 0) == 0)
+        return;
+#endif
+    long max = sysconf(_SC_OPEN_MAX);
+    if (max < 0 || max > 65536)
+        max = 65536;
+    for (int fd = 3; fd < max; fd++)
+    {
+        if (fd != keep)
+            close(fd);
+    }
+}
+
+static void zygote_serve(int sock)
+{
+    signal(SIGCHLD, SIG_IGN); // Los subshells se recogen solos
+    char *msg = xmalloc(ZYGOTE_MSG_MAX);
+
+    for (;;)
+    {
+        int fds[3];
+        char ctrl[CMSG_SPACE(sizeof(fds))];
+        struct iovec iov = {msg, ZYGOTE_MSG_MAX - 1};
+        struct msghdr mh = {0};
+        mh.msg_iov = &iov;
+        mh.msg_iovlen = 1;
+        mh.msg_control = ctrl;
+        mh.msg_controllen = sizeof(ctrl);
+
+        ssize_t n = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            _exit(0); // El shell cerró el socket
+
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+        if (!cm || cm->cmsg_type != SCM_RIGHTS || cm->cmsg_len != CMSG_LEN(sizeof(fds)))
+            continue;
+        memcpy(fds, CMSG_DATA(cm), sizeof(fds));
+        msg[n] = '\0';
+
+        if (sh_fork() == 0)
+        { // Subshell: "cwd\0comando"
+            signal(SIGCHLD, SIG_DFL);
+            close(sock);
+            for (int i = 0; i < 3; i++)
+                dup2(fds[i], i);
+            if (chdir(msg) != 0)
+                perror("shell");
+            run_line(msg + strlen(msg) + 1);
+            out_flush();
+            _exit(last_status);
+        }
+        for (int i = 0; i < 3; i++)
+            close(fds[i]);
+    }
+}
+
+void zygote_start(void)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0)
+    {
+        perror("shell: zygote");
+        return;
+    }
+
+    out_flush();
+    pid_t pid = sh_fork();
+    if (pid < 0)
+    {
+        perror("shell: zygote");
+        close(sv[0]);
+        close(sv[1]);
+        return;
+    }
+    if (pid == 0)
+    {
+        close(sv[0]);
+        zygote_fd = -1;
+        io_reset(); // Cierra su anillo antes de que el número se reutilice
+        close_fds_except(sv[1]);
+        coproc_forget_all(); // Sus descriptores ya no son de este proceso
+        zygote_serve(sv[1]);
+    }
+
+    close(sv[1]);
+    zygote_fd = sv[0];
+    zygote_pid = pid;
+    zygote_gen = state_gen;
+    zygote_enabled = 1;
+}
+
+// Entre comandos: sustituir el zygote si el estado cambió
+void zygote_refresh(void)
+{
+    if (!zygote_enabled || !zygote_missed)
+        return;
+    zygote_missed = 0;
+    if (zygote_fd >= 0)
+    {
+        close(zygote_fd); // El zygote termina al ver EOF
+        jobs_add(zygote_pid);
+        zygote_fd = -1;
+    }
+    zygote_start();
+}
+
+/*
+Pide al zygote un subshell que ejecute cmd[0..len) con 'fd' como stdout
+(reading) o stdin; el resto de descriptores son los actuales del shell.
+- Retorna: 0 si el zygote aceptó la petición, -1 para usar fork directo.
+*/
+int zygote_spawn(const char *cmd, size_t len, int fd, int reading)
+{
+    char cwd[4096];
+    if (zygote_enabled && (zygote_fd < 0 || zygote_gen != state_gen))
+        zygote_missed = 1;
+    if (zygote_fd < 0 || zygote_gen != state_gen || !getcwd(cwd, sizeof(cwd)))
+        return -1;
+
+    size_t cwd_len = strlen(cwd) + 1;
+    if (cwd_len + len >= ZYGOTE_MSG_MAX)
+        return -1;
+
+    struct strbuf msg = {0};
+    sb_append(&msg, cwd, cwd_len);
+    sb_append(&msg, cmd, len);
+
+    int fds[3] = {reading ? 0 : fd, reading ? fd : 1, 2};
+    char ctrl[CMSG_SPACE(sizeof(fds))];
+    memset(ctrl, 0, sizeof(ctrl));
+    struct iovec iov = {msg.data, msg.len};
+    struct msghdr mh = {0};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = ctrl;
+    mh.msg_controllen = sizeof(ctrl);
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&mh);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    out_flush();
+    ssize_t n;
+    while ((n = sendmsg(zygote_fd, &mh, MSG_NOSIGNAL)) < 0 && errno == EINTR)
+        ;
+    free(msg.data);
+    if (n < 0)
+    { // Zygote caído: no volver a intentarlo hasta renovarlo
+        close(zygote_fd);
+        zygote_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+#else
+void zygote_refresh(void)
+{
+}
+#endif
+
+// ==================== sustitución de procesos ====================
+/*
+<(cmd) y >(cmd): el comando interior se lanza en un subshell conectado a un
+pipe y el comando exterior recibe el otro extremo como /dev/fd/N.
+- Los subshells corren en paralelo con el comando exterior; los recoge
+  service_events() como cualquier otro trabajo.
+- procsub_close_all() cierra en el shell los extremos pasados al comando
+  exterior una vez lanzado, para que el lector vea EOF.
+*/
+#ifndef _WIN32
+static int *procsub_fds = NULL;
+static size_t procsub_count = 0, procsub_cap = 0;
+
+static int procsub_spawn(const char *cmd, size_t len, int reading)
+{
+    int fds[2];
+#ifdef SHELL_FUZZ
+    (void)cmd, (void)len, (void)reading, (void)fds;
+    return -1; // El arnés de fuzzing no lanza procesos
+#endif
+    if (pipe(fds) < 0)
+    {
+        perror("shell");
+        return -1;
+    }
+    // 'mine' se pasa al comando exterior; 'theirs' es del subshell
+    int mine = reading ? fds[0] : fds[1];
+    int theirs = reading ? fds[1] : fds[0];
+
+    if (zygote_spawn(cmd, len, theirs, reading) != 0)
+    {
+        out_flush();
+        pid_t pid = sh_fork();
+        if (pid < 0)
+        {
+            perror("shell");
+            close(fds[0]);
+            close(fds[1]);
+            return -1;
+        }
+        if (pid == 0)
+        { // Subshell: soltar los extremos ajenos para no retrasar su EOF
+            for (size_t i = 0; i < procsub_count; i++)
+                close(procsub_fds[i]);
+            close(mine);
+            dup2(theirs, reading ? 1 : 0);
+            close(theirs);
+
+            char *text = memcpy(xmalloc(len + 1), cmd, len);
+            text[len] = '\0';
+            run_line(text);
+            out_flush();
+            _exit(last_status); // _exit: no tocar los buffers de stdio del padre
+        }
+        jobs_add(pid);
+    }
+    close(theirs);
+
+    if (procsub_count == procsub_cap)
+    {
+        procsub_cap = procsub_cap ? procsub_cap * 2 : 4;
+        procsub_fds = xrealloc(procsub_fds, procsub_cap * sizeof(int));
+    }
+    procsub_fds[procsub_count++] = mine;
+    return mine;
+}
+
+void procsub_close_all(void)
+{
+    for (size_t i = 0; i < procsub_count; i++)
+        close(procsub_fds[i]);
+    procsub_count = 0;
+}
+#else
+void procsub_close_all(void)
+{
+}
+#endif
+
+// ==================== lotes de argumentos ====================
+/*
+Evita los fallos E2BIG de execvp con listas de argumentos enormes.
+- arg_budget(): bytes disponibles para argv según sysconf(_SC_ARG_MAX),
+  descontando lo que ocupa el entorno y un margen de seguridad.
+- arg_too_long(): Linux además limita cada argumento a 32 páginas
+  (MAX_ARG_STRLEN); uno mayor no cabe en ningún lote.
+- run_batches(): ejecuta prefijo + elementos en lotes que caben en ese
+  presupuesto, con hasta 'maxprocs' lotes en paralelo.
+*/
+#ifndef _WIN32
+#define ARG_HEADROOM 4096 // Margen para auxv, nombre del ejecutable, etc.
+
+// Comandos cuyos operandos pueden repartirse en varias invocaciones
+static const char *batchable_cmds[] = {"rm", "rmdir", "touch", "mkdir"};
+
+static size_t arg_cost(const char *arg)
+{
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+static long arg_budget(void)
+{
+    long max = sysconf(_SC_ARG_MAX);
+    if (max <= 0)
+        max = 128 * 1024; // Mínimo histórico de Linux
+
+    env_sync(); // Contar lo exportado desde el último fork
+    for (char **e = environ; *e; e++)
+        max -= arg_cost(*e);
+    return max - ARG_HEADROOM;
+}
+
+static int arg_too_long(const char *arg)
+{
+#ifdef __linux__
+    long page = sysconf(_SC_PAGESIZE);
+    return strlen(arg) >= (size_t)(page > 0 ? page : 4096) * 32;
+#else
+    (void)arg;
+    return 0;
+#endif
+}
+
+static int is_batchable(const char *cmd)
+{
+    for (size_t i = 0; i < sizeof(batchable_cmds) / sizeof(batchable_cmds[0]); i++)
+    {
+        if (strcmp(batchable_cmds[i], cmd) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+/*
+Espera a que termine uno de pids[0..running), sin recoger nunca otros
+hijos (las etapas anteriores de "ls | xargs rm", coprocesos...), que son
+de quien los lanzó.
+- Primero waitpid(WNOHANG) en cada lote; si ninguno ha terminado, poll()
+  sobre un pidfd por lote, que despierta con el primero que acabe.
+- Sin pidfd (Linux < 5.3 u otro Unix) se bloquea en pids[0]: los lotes se
+  recogen en orden de lanzamiento, pero nunca se toca un hijo ajeno.
+- Retorna: El pid recogido, o -1 (errno).
+*/
+static pid_t wait_own(const pid_t *pids, int running, int *wstatus)
+{
+    for (;;)
+    {
+        for (int slot = 0; slot < running; slot++)
+        {
+            pid_t pid = waitpid(pids[slot], wstatus, WNOHANG);
+            if (pid != 0)
+                return pid;
+        }
+#if defined(__linux__) && defined(SYS_pidfd_open)
+        struct pollfd fds[running];
+        int n = 0;
+        for (; n < running; n++)
+        {
+            fds[n].fd = (int)syscall(SYS_pidfd_open, pids[n], 0);
+            fds[n].events = POLLIN;
+            if (fds[n].fd < 0)
+                break;
+        }
+        int ready = n == running ? poll(fds, n, -1) : -2;
+        int saved = errno;
+        while (n > 0)
+            close(fds[--n].fd);
+        if (ready == -1 && saved == EINTR)
+        {
+            errno = EINTR;
+            return -1;
+        }
+        if (ready >= 0)
+            continue; // Alguno terminó: recogerlo arriba
+#endif
+        return waitpid(pids[0], wstatus, 0);
+    }
+}
+
+/*
+Ejecuta prefix[0..nprefix) seguido de tantos elementos de items como quepan.
+- maxargs: máximo de elementos por lote (0 = sin límite).
+- null_stdin: los hijos leen de /dev/null (los elementos vinieron de stdin).
+- Retorna: 0 si todos los lotes terminaron bien, o el último código de error.
+*/
+int run_batches(char **prefix, size_t nprefix, char **items, size_t nitems,
+                int maxprocs, size_t maxargs, int null_stdin)
+{
+    long budget = arg_budget();
+    char **argv = xmalloc((nprefix + nitems + 1) * sizeof(char *));
+    pid_t *pids = xmalloc(maxprocs * sizeof(pid_t));
+    uint64_t *started = xmalloc(maxprocs * sizeof(uint64_t)); // probe_now() del spawn de cada lote
+    int running = 0, result = 0;
+    size_t next = 0;
+
+    long fixed = 0;
+    for (size_t i = 0; i < nprefix; i++)
+    {
+        argv[i] = prefix[i];
+        fixed += arg_cost(prefix[i]);
+    }
+
+    out_flush();
+    while (next < nitems || running > 0)
+    {
+        if (next < nitems && running < maxprocs)
+        {
+            size_t n = 0;
+            long used = fixed;
+            while (next + n < nitems && (maxargs == 0 || n < maxargs))
+            {
+                long cost = arg_cost(items[next + n]);
+                if (used + cost > budget || arg_too_long(items[next + n]))
+                    break;
+                used += cost;
+                argv[nprefix + n] = items[next + n];
+                n++;
+            }
+            if (n == 0)
+            {
+                fprintf(stderr, "shell: argumento demasiado largo: %.40s...\n", items[next]);
+                result = 1;
+                break;
+            }
+            argv[nprefix + n] = NULL;
+            next += n;
+
+            pid_t pid = sh_fork();
+            if (pid < 0)
+            {
+                perror("shell");
+                result = 1;
+                break;
+            }
+            if (pid == 0)
+            {
+                if (null_stdin)
+                {
+                    int fd = open("/dev/null", O_RDONLY);
+                    dup2(fd, 0);
+                    close(fd);
+                }
+                exec_command(argv);
+                perror("shell");
+                _exit(127);
+            }
+            PROBE2(spawn, argv[0], pid);
+            started[running] = probe_now();
+            pids[running++] = pid;
+            continue;
+        }
+
+        // Sin hueco libre (o sin más lotes): esperar a uno de nuestros lotes
+        int wstatus, slot;
+        pid_t pid = wait_own(pids, running, &wstatus);
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        for (slot = 0; slot < running && pids[slot] != pid; slot++)
+            ;
+        PROBE3(reap, pid, WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus),
+               probe_now() - started[slot]);
+        running--;
+        pids[slot] = pids[running];
+        started[slot] = started[running];
+        if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0)
+            result = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    }
+
+    // Si se cortó por un error, recoger los lotes que siguen corriendo
+    while (running > 0)
+        waitpid(pids[--running], NULL, 0);
+
+    free(started);
+    free(pids);
+    free(argv);
+    return result;
+}
+#endif
+
+// ==================== builtins ====================
+/*
+Comandos internos del shell.
+- Cada builtin recibe los argumentos y retorna su código de salida.
+- 'exit [N]' activa exit_requested para que launch() termine el bucle;
+  el shell sale con N (por defecto, el estado del último comando).
+*/
+static int exit_requested = 0;
+
+static int builtin_exit(char **args)
+{
+    exit_requested = 1;
+    return args[1] ? atoi(args[1]) & 0xff : last_status;
+}
+
+static int builtin_echo(char **args)
+{
+    for (int i = 1; args[i]; i++)
+    {
+        out_write(args[i], strlen(args[i]));
+        if (args[i + 1])
+            out_write(" ", 1);
+    }
+    out_write("\n", 1);
+    return 0;
+}
+
+static int builtin_cd(char **args)
+{
+    char *dir = args[1] ? args[1] : getenv("HOME");
+
+#ifdef _WIN32
+    if (_chdir(dir) != 0)
+    {
+#else
+    if (chdir(dir) != 0)
+    {
+#endif
+        perror("shell");
+        return 1;
+    }
+    return 0;
+}
+
+// ------ Comando: mapfile / readarray ------
+/*
+mapfile [-t] [NOMBRE] < archivo
+- Carga cada línea de la entrada estándar como elemento del array NOMBRE
+  (MAPFILE por defecto). Con -t se quita el salto de línea final.
+- La entrada se copia a un bloque del heap (read_all: con archivos
+  regulares, una reserva del tamaño exacto) y los elementos apuntan a él.
+  No se usa mmap: si otro proceso trunca o modifica el archivo, el array
+  no debe cambiar ni provocar un SIGBUS.
+- La división usa memchr, que glibc implementa con instrucciones SIMD.
+*/
+// Divide [data, data+len) en líneas y las guarda como spans de v
+static void split_spans(struct var *v, const char *data, size_t len, int strip)
+{
+    size_t cap = 1024;
+    const char *p = data, *end = data + len;
+
+    v->items = xmalloc(cap * sizeof(struct span));
+    v->count = 0;
+
+    while (p < end)
+    {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *stop = nl ? nl + 1 : end;
+
+        if (v->count == cap)
+        {
+            cap *= 2;
+            v->items = xrealloc(v->items, cap * sizeof(struct span));
+        }
+        v->items[v->count].ptr = p;
+        v->items[v->count].len = (nl && strip) ? (size_t)(nl - p) : (size_t)(stop - p);
+        v->count++;
+        p = stop;
+    }
+}
+
+static int builtin_mapfile(char **args)
+{
+    int strip = 0;
+    const char *name = "MAPFILE";
+    int i = 1;
+
+    for (; args[i] && args[i][0] == '-'; i++)
+    {
+        if (strcmp(args[i], "-t") == 0)
+            strip = 1;
+        else
+        {
+            fprintf(stderr, "mapfile: opción inválida: %s\n", args[i]);
+            return 2;
+        }
+    }
+    if (args[i])
+        name = args[i];
+    if (!valid_name(name))
+    {
+        fprintf(stderr, "mapfile: nombre de variable inválido: %s\n", name);
+        return 1;
+    }
+
+    size_t len;
+    char *data = read_all(0, &len);
+    if (!data)
+        return 1;
+
+    struct var *v = var_get(name);
+    v->backing = data;
+    v->backing_len = len;
+    v->backing_kind = BACK_HEAP;
+    split_spans(v, data, len, strip);
+    return 0;
+}
+
+// ------ Comando: xargs ------
+/*
+xargs [-P N] [-n N] [-a ARCHIVO] [comando [args...]]
+- Lee elementos separados por blancos de ARCHIVO (o de stdin) y ejecuta el
+  comando con el mayor número de ellos que permite ARG_MAX.
+- -n limita los elementos por invocación; -P ejecuta hasta N lotes a la vez
+  (0 = uno por CPU).
+*/
+static int builtin_xargs(char **args)
+{
+#ifdef _WIN32
+    (void)args;
+    fprintf(stderr, "xargs: no soportado en Windows\n");
+    return 1;
+#else
+    int maxprocs = 1;
+    size_t maxargs = 0;
+    const char *file = NULL;
+    int i = 1;
+
+    for (; args[i] && args[i][0] == '-'; i++)
+    {
+        const char *opt = args[i];
+        if (strcmp(opt, "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (strcmp(opt, "-P") && strcmp(opt, "-n") && strcmp(opt, "-a"))
+        {
+            fprintf(stderr, "xargs: opción inválida: %s\n", opt);
+            return 2;
+        }
+        if (!args[i + 1])
+        {
+            fprintf(stderr, "xargs: %s requiere un argumento\n", opt);
+            return 2;
+        }
+        i++;
+        if (opt[1] == 'P')
+            maxprocs = atoi(args[i]);
+        else if (opt[1] == 'n')
+            maxargs = strtoul(args[i], NULL, 10);
+        else
+            file = args[i];
+    }
+    if (maxprocs <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        maxprocs = cpus > 0 ? (int)cpus : 1;
+    }
+
+    int fd = 0;
+    if (file && (fd = open(file, O_RDONLY)) < 0)
+    {
+        fprintf(stderr, "xargs: %s: %s\n", file, strerror(errno));
+        return 1;
+    }
+    size_t len;
+    char *data = read_all(fd, &len);
+    if (fd != 0)
+        close(fd);
+    if (!data)
+        return 1;
+
+    // Dividir en elementos in situ (terminando cada uno con '\0')
+    size_t cap = 1024, nitems = 0;
+    char **items = xmalloc(cap * sizeof(char *));
+    data[len] = '\0'; // read_all siempre deja al menos un byte libre
+    for (char *tok = strtok(data, TOK_DELIM); tok; tok = strtok(NULL, TOK_DELIM))
+    {
+        if (nitems == cap)
+        {
+            cap *= 2;
+            items = xrealloc(items, cap * sizeof(char *));
+        }
+        items[nitems++] = tok;
+    }
+
+    char *echo_cmd[] = {"echo", NULL};
+    char **prefix = args[i] ? &args[i] : echo_cmd;
+    size_t nprefix = 0;
+    while (prefix[nprefix])
+        nprefix++;
+
+    int status = 0;
+    if (nitems > 0)
+        status = run_batches(prefix, nprefix, items, nitems, maxprocs, maxargs, !file);
+
+    free(items);
+    free(data);
+    return status ? 123 : 0; // Igual que xargs de GNU
+#endif
+}
+
+// ------ Comando: coproc ------
+/*
+coproc NOMBRE comando [args...]   Lanza un coproceso.
+coproc -c NOMBRE                  Cierra su entrada (le envía EOF).
+- El coproceso queda conectado al shell por dos pipes: NOMBRE[0] es el
+  descriptor para leer su salida y NOMBRE[1] el de escribir en su entrada;
+  NOMBRE_PID guarda su pid.
+- Uso: echo 2+2 >&${BC[1]}  y  read -u ${BC[0]} resultado
+- El extremo de lectura es no bloqueante; read lo atiende con poll() y un
+  buffer propio, así cada respuesta cuesta una sola llamada a read().
+*/
+#ifndef _WIN32
+struct coproc
+{
+    char *name;
+    pid_t pid;
+    int rfd, wfd;
+    struct strbuf in; // Datos leídos aún no consumidos por read
+    size_t in_pos;
+    struct coproc *next;
+};
+
+static struct coproc *coprocs = NULL;
+
+// Tras close_fds_except() en el zygote: olvidar la tabla sin cerrar nada
+void coproc_forget_all(void)
+{
+    coprocs = NULL;
+}
+
+static struct coproc *coproc_by_name(const char *name)
+{
+    for (struct coproc *c = coprocs; c; c = c->next)
+    {
+        if (strcmp(c->name, name) == 0)
+            return c;
+    }
+    return NULL;
+}
+
+static struct coproc *coproc_by_rfd(int fd)
+{
+    for (struct coproc *c = coprocs; c; c = c->next)
+    {
+        if (c->rfd == fd)
+            return c;
+    }
+    return NULL;
+}
+
+static void coproc_close(struct coproc *c)
+{
+    if (c->rfd >= 0)
+        close(c->rfd);
+    if (c->wfd >= 0)
+        close(c->wfd);
+    c->rfd = c->wfd = -1;
+    c->in.len = c->in_pos = 0;
+}
+
+/*
+Lee una línea del coproceso a 'line' (sin el '\n').
+- Retorna: 0 si leyó una línea, 1 en EOF sin datos, -1 si hubo error.
+*/
+static int coproc_getline(struct coproc *c, struct strbuf *line)
+{
+    for (;;)
+    {
+        const char *start = c->in.data + c->in_pos;
+        size_t avail = c->in.len - c->in_pos;
+        const char *nl = avail ? memchr(start, '\n', avail) : NULL;
+
+        if (nl)
+        {
+            sb_append(line, start, nl - start);
+            c->in_pos += nl - start + 1;
+            return 0;
+        }
+
+        // Compactar y leer lo que haya disponible
+        memmove(c->in.data, start, avail);
+        c->in.len = avail;
+        c->in_pos = 0;
+        sb_reserve(&c->in, READ_BLOCK);
+
+        ssize_t n = sh_read(c->rfd, c->in.data + c->in.len, c->in.cap - c->in.len - 1);
+        if (n > 0)
+        {
+            c->in.len += n;
+            continue;
+        }
+        if (n == 0)
+        { // EOF: devolver el resto sin '\n' si lo hay
+            if (!avail)
+                return 1;
+            sb_append(line, c->in.data, avail);
+            c->in.len = 0;
+            return 0;
+        }
+        if (errno == EAGAIN || errno == EINTR)
+        {
+            struct pollfd pfd = {c->rfd, POLLIN, 0};
+            poll(&pfd, 1, -1);
+            continue;
+        }
+        perror("read");
+        return -1;
+    }
+}
+#endif
+
+static int builtin_coproc(char **args)
+{
+#ifdef _WIN32
+    (void)args;
+    fprintf(stderr, "coproc: no soportado en Windows\n");
+    return 1;
+#else
+    if (args[1] && strcmp(args[1], "-c") == 0)
+    {
+        struct coproc *c = args[2] ? coproc_by_name(args[2]) : NULL;
+        if (!c)
+        {
+            fprintf(stderr, "coproc: no existe el coproceso: %s\n", args[2] ? args[2] : "");
+            return 1;
+        }
+        if (c->wfd >= 0)
+            close(c->wfd);
+        c->wfd = -1;
+        return 0;
+    }
+
+    if (!args[1] || !args[2] || !valid_name(args[1]))
+    {
+        fprintf(stderr, "uso: coproc NOMBRE comando [args...]\n");
+        return 2;
+    }
+
+    // to_child: shell -> coproceso, from_child: coproceso -> shell
+    int to_child[2], from_child[2];
+    if (pipe2(to_child, O_CLOEXEC) < 0)
+    {
+        perror("coproc");
+        return 1;
+    }
+    if (pipe2(from_child, O_CLOEXEC) < 0)
+    {
+        perror("coproc");
+        close(to_child[0]);
+        close(to_child[1]);
+        return 1;
+    }
+
+    out_flush();
+    pid_t pid = sh_fork();
+    if (pid < 0)
+    {
+        perror("coproc");
+        close(to_child[0]);
+        close(to_child[1]);
+        close(from_child[0]);
+        close(from_child[1]);
+        return 1;
+    }
+    if (pid == 0)
+    { // Hijo: los extremos O_CLOEXEC se cierran solos en execvp
+        dup2(to_child[0], 0);
+        dup2(from_child[1], 1);
+        exec_command(&args[2]);
+        perror("coproc");
+        _exit(127);
+    }
+
+    close(to_child[0]);
+    close(from_child[1]);
+    fcntl(from_child[0], F_SETFL, fcntl(from_child[0], F_GETFL) | O_NONBLOCK);
+    jobs_add(pid);
+
+    struct coproc *c = coproc_by_name(args[1]);
+    if (c)
+        coproc_close(c);
+    else
+    {
+        c = xmalloc(sizeof(*c));
+        memset(&c->in, 0, sizeof(c->in));
+        c->name = xstrdup(args[1]);
+        c->next = coprocs;
+        coprocs = c;
+    }
+    c->pid = pid;
+    c->rfd = from_child[0];
+    c->wfd = to_child[1];
+    c->in_pos = 0;
+
+    // NOMBRE=(rfd wfd) y NOMBRE_PID
+    char rfd[16], wfd[16], pidstr[16];
+    snprintf(rfd, sizeof(rfd), "%d", c->rfd);
+    snprintf(wfd, sizeof(wfd), "%d", c->wfd);
+    snprintf(pidstr, sizeof(pidstr), "%d", (int)pid);
+    const char *fds[] = {rfd, wfd};
+    var_set_words(args[1], fds, 2);
+
+    struct strbuf pidvar = {0};
+    sb_append(&pidvar, args[1], strlen(args[1]));
+    sb_append(&pidvar, "_PID", 4);
+    var_set_scalar(pidvar.data, pidstr);
+    free(pidvar.data);
+    return 0;
+#endif
+}
+
+// ------ Comando: read ------
+/*
+read [-u FD] [NOMBRE...]
+- Lee una línea de FD (stdin por defecto) y la reparte en palabras entre
+  las variables; la última recibe el resto de la línea (REPLY si no hay).
+- Retorna: 1 al llegar a EOF sin datos.
+*/
+static int read_line_fd(int fd, struct strbuf *line)
+{
+#ifndef _WIN32
+    struct coproc *c = coproc_by_rfd(fd);
+    if (c)
+        return coproc_getline(c, line);
+#endif
+
+    if (fd == 0 && !stdin_redirected)
+    { // Entrada del propio shell: compartir el buffer de stdio
+        char chunk[1024];
+        int got = 0;
+        while (input_gets(chunk, sizeof(chunk)))
+        {
+            size_t len = strlen(chunk);
+            got = 1;
+            if (len && chunk[len - 1] == '\n')
+            {
+                sb_append(line, chunk, len - 1);
+                return 0;
+            }
+            sb_append(line, chunk, len);
+        }
+        return got ? 0 : 1;
+    }
+
+    // Otros descriptores: byte a byte para no consumir más de una línea
+    int got = 0;
+    for (;;)
+    {
+        char ch;
+        ssize_t n = sh_read(fd, &ch, 1);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return got ? 0 : (n < 0 ? -1 : 1);
+        got = 1;
+        if (ch == '\n')
+            return 0;
+        sb_putc(line, ch);
+    }
+}
+
+static int builtin_read(char **args)
+{
+    int fd = 0, i = 1;
+
+    if (args[1] && strcmp(args[1], "-u") == 0)
+    {
+        if (!args[2])
+        {
+            fprintf(stderr, "read: -u requiere un descriptor\n");
+            return 2;
+        }
+        fd = atoi(args[2]);
+        i = 3;
+    }
+
+    struct strbuf line = {0};
+    int rc = read_line_fd(fd, &line);
+    if (rc != 0)
+    {
+        free(line.data);
+        return 1;
+    }
+    sb_reserve(&line, 0); // Garantiza line.data != NULL
+
+    const char *reply[] = {"REPLY", NULL};
+    char **names = args[i] ? &args[i] : (char **)reply;
+    char *p = line.data;
+
+    for (int n = 0; names[n]; n++)
+    {
+        if (!valid_name(names[n]))
+        {
+            fprintf(stderr, "read: nombre de variable inválido: %s\n", names[n]);
+            free(line.data);
+            return 1;
+        }
+        p += strspn(p, " \t");
+        if (!names[n + 1])
+        { // Última variable: el resto sin blancos finales
+            char *end = p + strlen(p);
+            while (end > p && (end[-1] == ' ' || end[-1] == '\t'))
+                end--;
+            *end = '\0';
+            var_set_scalar(names[n], p);
+            break;
+        }
+        char *word = p;
+        p += strcspn(p, " \t");
+        if (*p)
+            *p++ = '\0';
+        var_set_scalar(names[n], word);
+    }
+
+    free(line.data);
+    return 0;
+}
+
+// ------ Comando: memo ------
+/*
+memo [--ttl SEGUNDOS] [--dep ARCHIVO]... [--env VAR]... comando [args...]
+- Guarda stdout, stderr y el código de salida del comando en una caché en
+  disco ($SHELL_MEMO_DIR, o $XDG_CACHE_HOME/shell-memo, o ~/.cache/shell-memo).
+- La clave es un hash de argv, el directorio actual, las variables elegidas
+  con --env y el estado (dispositivo, inodo, tamaño, mtime) de cada --dep.
+- Si hay entrada válida (y no ha caducado según --ttl) se devuelve la salida
+  guardada con copy_fd() sin ejecutar el comando.
+- stdin no forma parte de la clave: el comando lo hereda tal cual, así que
+  un comando que lea de stdin reutiliza la salida de la primera entrada
+  que recibió (usar --dep con el archivo redirigido para distinguirlas).
+*/
+#ifndef _WIN32
+#define MEMO_MAX_OPTS 64 // Máximo de --dep/--env por invocación
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t fnv1a_str(uint64_t h, const char *s)
+{
+    return fnv1a(h, s, strlen(s) + 1); // Incluye el '\0' como separador
+}
+
+/*
+Crea (si hace falta) el directorio de la caché y lo deja en 'dir'.
+- Sin SHELL_MEMO_DIR, XDG_CACHE_HOME ni HOME se usa /tmp/shell-memo-UID.
+- Venga de donde venga, tiene que ser un directorio real (no un enlace)
+  del usuario y sin permisos para otros: si no, otro usuario podría dejar
+  salidas falsas que memo reproduciría como si fueran del comando.
+*/
+static int memo_dir(struct strbuf *dir)
+{
+    const char *base = getenv("SHELL_MEMO_DIR");
+    if (base)
+        sb_append(dir, base, strlen(base));
+    else
+    {
+        const char *xdg = getenv("XDG_CACHE_HOME");
+        const char *home = getenv("HOME");
+        if (xdg)
+            sb_append(dir, xdg, strlen(xdg));
+        else if (home)
+        {
+            sb_append(dir, home, strlen(home));
+            sb_append(dir, "/.cache", 7);
+            mkdir(dir->data, 0755);
+        }
+        if (xdg || home)
+            sb_append(dir, "/shell-memo", 11);
+        else
+        {
+            char name[64];
+            int n = snprintf(name, sizeof(name), "/tmp/shell-memo-%lu", (unsigned long)getuid());
+            sb_append(dir, name, n);
+        }
+    }
+
+    if (mkdir(dir->data, 0700) < 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "memo: %s: %s\n", dir->data, strerror(errno));
+        return -1;
+    }
+    struct stat st;
+    if (lstat(dir->data, &st) != 0 || !S_ISDIR(st.st_mode) ||
+        st.st_uid != getuid() || (st.st_mode & 077) != 0)
+    {
+        fprintf(stderr, "memo: %s: no es un directorio propio con permisos 0700\n", dir->data);
+        return -1;
+    }
+    return 0;
+}
+
+// Vuelca el archivo 'path' en el descriptor 'out'
+static void memo_replay(const char *path, int out)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return;
+    copy_fd(fd, out);
+    close(fd);
+}
+
+static int memo_run(char **argv, const char *out_path, const char *err_path)
+{
+    int out = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int err = open(err_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (out < 0 || err < 0)
+    {
+        perror("memo");
+        if (out >= 0)
+            close(out);
+        if (err >= 0)
+            close(err);
+        return -1;
+    }
+
+    out_flush();
+    pid_t pid = sh_fork();
+    if (pid == 0)
+    {
+        dup2(out, 1);
+        dup2(err, 2);
+        exec_command(argv);
+        perror("shell");
+        _exit(127);
+    }
+    close(out);
+    close(err);
+    if (pid < 0)
+    {
+        perror("memo");
+        return -1;
+    }
+
+    int wstatus;
+    while (waitpid(pid, &wstatus, 0) < 0 && errno == EINTR)
+        ;
+    return WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+}
+#endif
+
+static int builtin_memo(char **args)
+{
+#ifdef _WIN32
+    (void)args;
+    fprintf(stderr, "memo: no soportado en Windows\n");
+    return 1;
+#else
+    const char *deps[MEMO_MAX_OPTS], *envs[MEMO_MAX_OPTS];
+    int ndeps = 0, nenvs = 0;
+    long ttl = 0;
+    int i = 1;
+
+    for (; args[i] && strncmp(args[i], "--", 2) == 0; i++)
+    {
+        const char *opt = args[i];
+        if (strcmp(opt, "--") == 0)
+        {
+            i++;
+            break;
+        }
+        if (!args[i + 1])
+        {
+            fprintf(stderr, "memo: %s requiere un argumento\n", opt);
+            return 2;
+        }
+        if (strcmp(opt, "--ttl") == 0)
+            ttl = atol(args[++i]);
+        else if (strcmp(opt, "--dep") == 0 && ndeps < MEMO_MAX_OPTS)
+            deps[ndeps++] = args[++i];
+        else if (strcmp(opt, "--env") == 0 && nenvs < MEMO_MAX_OPTS)
+            envs[nenvs++] = args[++i];
+        else
+        {
+            fprintf(stderr, "memo: opción inválida: %s\n", opt);
+            return 2;
+        }
+    }
+    if (!args[i])
+    {
+        fprintf(stderr, "uso: memo [--ttl N] [--dep ARCHIVO]... [--env VAR]... comando [args...]\n");
+        return 2;
+    }
+
+    // Clave: argv + directorio actual + entorno elegido + estado de dependencias
+    uint64_t h = 14695981039346656037ULL;
+    for (int a = i; args[a]; a++)
+        h = fnv1a_str(h, args[a]);
+    char cwd[4096];
+    if (getcwd(cwd, sizeof(cwd)))
+        h = fnv1a_str(h, cwd);
+    for (int e = 0; e < nenvs; e++)
+    {
+        const char *val = getenv(envs[e]);
+        h = fnv1a_str(h, envs[e]);
+        h = val ? fnv1a_str(h, val) : fnv1a(h, "", 0);
+    }
+    for (int d = 0; d < ndeps; d++)
+    {
+        struct stat st;
+        h = fnv1a_str(h, deps[d]);
+        if (stat(deps[d], &st) == 0)
+        {
+            uint64_t fields[] = {st.st_dev, st.st_ino, st.st_size,
+                                 st.st_mtim.tv_sec, st.st_mtim.tv_nsec};
+            h = fnv1a(h, fields, sizeof(fields));
+        }
+    }
+
+    struct strbuf base = {0};
+    if (memo_dir(&base) != 0)
+    {
+        free(base.data);
+        return 1;
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "/%016llx", (unsigned long long)h);
+    sb_append(&base, name, strlen(name));
+    size_t base_len = base.len;
+
+    // Rutas: <clave>.meta, .out y .err
+    char *meta = xmalloc(base_len + 32), *out = xmalloc(base_len + 32), *err = xmalloc(base_len + 32);
+    snprintf(meta, base_len + 32, "%s.meta", base.data);
+    snprintf(out, base_len + 32, "%s.out", base.data);
+    snprintf(err, base_len + 32, "%s.err", base.data);
+
+    int status = -1;
+    FILE *mf = fopen(meta, "r");
+    if (mf)
+    {
+        int code;
+        long long created;
+        if (fscanf(mf, "%d %lld", &code, &created) == 2 &&
+            (ttl <= 0 || time(NULL) - created < ttl))
+            status = code;
+        fclose(mf);
+    }
+
+    if (status >= 0)
+    { // Acierto: la salida guardada
+        out_flush();
+        memo_replay(out, cur_out->fd);
+        memo_replay(err, 2);
+    }
+    else
+    { // Fallo de caché: ejecutar guardando en temporales y publicar con rename
+        char *tmp_out = xmalloc(base_len + 48), *tmp_err = xmalloc(base_len + 48);
+        char *tmp_meta = xmalloc(base_len + 48);
+        snprintf(tmp_out, base_len + 48, "%s.out.%d", base.data, (int)getpid());
+        snprintf(tmp_err, base_len + 48, "%s.err.%d", base.data, (int)getpid());
+        snprintf(tmp_meta, base_len + 48, "%s.meta.%d", base.data, (int)getpid());
+
+        status = memo_run(&args[i], tmp_out, tmp_err);
+        const char *run_out = tmp_out, *run_err = tmp_err; // Dónde quedó la salida de esta ejecución
+        int saved = 0;
+        if (status >= 0 && (mf = fopen(tmp_meta, "w")))
+        {
+            fprintf(mf, "%d %lld\n", status, (long long)time(NULL));
+            if (fclose(mf) == 0)
+            {
+                unlink(meta); // Sin .meta la entrada vieja no vale mientras se sustituye
+                if (rename(tmp_out, out) == 0)
+                    run_out = out;
+                if (rename(tmp_err, err) == 0)
+                    run_err = err;
+                // El .meta publica la entrada completa
+                saved = run_out == out && run_err == err && rename(tmp_meta, meta) == 0;
+            }
+        }
+        if (status >= 0)
+        { // Aunque no se haya podido guardar, se muestra esta ejecución
+            out_flush();
+            memo_replay(run_out, cur_out->fd);
+            memo_replay(run_err, 2);
+        }
+        if (!saved)
+        {
+            unlink(tmp_out);
+            unlink(tmp_err);
+            unlink(tmp_meta);
+        }
+        free(tmp_out);
+        free(tmp_err);
+        free(tmp_meta);
+    }
+
+    free(meta);
+    free(out);
+    free(err);
+    free(base.data);
+    return status < 0 ? 1 : status;
+#endif
+}
+
+// ------ Comando: cat ------
+/*
+cat [ARCHIVO|-]...
+- Concatena los archivos (o stdin) en stdout usando copy_fd(), que elige
+  copy_file_range/splice/sendfile según los descriptores.
+- Los archivos se abren por lotes con io_batch_run() antes de copiarlos.
+*/
+static int builtin_cat(char **args)
+{
+    static char *stdin_only[] = {"-", NULL};
+    char **files = args[1] ? &args[1] : stdin_only;
+    struct io_op ops[IO_BATCH];
+    int status = 0;
+
+    out_flush();
+    for (int i = 0; files[i];)
+    {
+        // Abrir en lote los archivos que siguen (hasta el próximo '-')
+        int n = 0;
+        while (n < IO_BATCH && files[i + n] && strcmp(files[i + n], "-") != 0)
+        {
+            ops[n] = (struct io_op){IO_OPEN, files[i + n], O_RDONLY | O_BINARY, 0, NULL, 0};
+            n++;
+        }
+        io_batch_run(ops, n);
+
+        int is_stdin = n == 0; // files[i] es "-"
+        for (int k = 0; k < (is_stdin ? 1 : n); k++)
+        {
+            int fd = is_stdin ? cur_in : ops[k].res;
+            if (fd < 0)
+                errno = -fd;
+            if (fd < 0 || copy_fd(fd, cur_out->fd) != 0)
+            {
+                if (errno == EPIPE)
+                { // El lector se fue: cerrar lo abierto y terminar
+                    for (; !is_stdin && k < n; k++)
+                    {
+                        if (ops[k].res >= 0)
+                            close(ops[k].res);
+                    }
+                    return 1;
+                }
+                fprintf(stderr, "cat: %s: %s\n", files[i + k], strerror(errno));
+                status = 1;
+            }
+            if (fd >= 0 && !is_stdin)
+                close(fd);
+        }
+        i += is_stdin ? 1 : n;
+    }
+    return status;
+}
+
+// ------ Comando: walk ------
+/*
+walk [-type f|d|l] [-name PATRÓN] [-newer ARCHIVO] [-print0] [-j N] [DIR...]
+- Recorre los árboles (por defecto '.') e imprime las rutas que cumplen
+  todos los filtros, como un find reducido: recorrido en preorden y sin
+  seguir enlaces simbólicos.
+- Cada subdirectorio es una tarea. Cada uno de los N hilos (por defecto uno
+  por CPU) saca tareas del final de su propia cola y, si se queda sin
+  trabajo, roba del principio de la cola de otro: los directorios más
+  antiguos, que suelen tener más árbol debajo.
+- Linux: las entradas se leen con getdents64 sobre el descriptor de openat.
+  El tipo sale de d_type; solo se hace fstatat si el sistema de archivos no
+  lo informa o si hace falta la fecha (-newer).
+- Cada hilo acumula su salida y la vuelca en bloques de rutas completas:
+  el orden entre directorios no es determinista (usar '| sort').
+*/
+#ifndef _WIN32
+#define WALK_BUF (64 * 1024)   // Salida acumulada por hilo antes de volcarla
+#define WALK_DENTS (32 * 1024) // Bytes por llamada a getdents64
+#define WALK_MAX_THREADS 64
+
+struct walk_task
+{
+    char *path;
+    size_t len;
+};
+
+// Cola de un hilo: el dueño usa el final, los ladrones el principio
+struct walk_queue
+{
+    pthread_mutex_t lock;
+    struct walk_task *tasks;
+    size_t head, tail, cap; // Pendientes: [head, tail)
+};
+
+struct walk_ctx
+{
+    int type;         // 0 (cualquiera), 'f', 'd' o 'l'
+    const char *name; // Patrón sobre el último componente, o NULL
+    int newer;
+    int64_t newer_sec;
+    long newer_nsec;
+    char sep; // '\n', o '\0' con -print0
+
+    int out_fd;
+    pthread_mutex_t out_lock;
+    int stop;   // El lector se fue: dejar de recorrer
+    int status;
+
+    int nthreads;
+    struct walk_queue *queues;
+    size_t pending; // Tareas encoladas o en curso
+    unsigned gen;   // Cambia con cada tarea nueva
+    int idle;       // Hilos esperando trabajo
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle_cond;
+};
+
+struct walk_worker
+{
+    struct walk_ctx *ctx;
+    int id;
+    pthread_t tid;
+    size_t len;
+    char buf[WALK_BUF];
+#ifdef __linux__
+    char dents[WALK_DENTS];
+#endif
+};
+
+#include <dirent.h> // DT_REG, DT_DIR... (y fdopendir/readdir fuera de Linux)
+#ifdef __linux__
+#include <sys/syscall.h> // SYS_getdents64
+
+struct walk_dirent64
+{
+    uint64_t d_ino;
+    int64_t d_off;
+    unsigned short d_reclen;
+    unsigned char d_type;
+    char d_name[];
+};
+#endif
+
+static void walk_push(struct walk_ctx *ctx, int id, char *path, size_t len)
+{
+    struct walk_queue *q = &ctx->queues[id];
+    __atomic_add_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+
+    pthread_mutex_lock(&q->lock);
+    if (q->tail == q->cap)
+    {
+        if (q->head > 0)
+        { // Compactar antes de crecer
+            memmove(q->tasks, q->tasks + q->head, (q->tail - q->head) * sizeof(*q->tasks));
+            q->tail -= q->head;
+            q->head = 0;
+        }
+        else
+        {
+            q->cap = q->cap ? q->cap * 2 : 64;
+            q->tasks = xrealloc(q->tasks, q->cap * sizeof(*q->tasks));
+        }
+    }
+    q->tasks[q->tail].path = path;
+    q->tasks[q->tail].len = len;
+    q->tail++;
+    pthread_mutex_unlock(&q->lock);
+
+    /* Despertar a los ociosos. Con gen e idle secuencialmente consistentes,
+       o el hilo que se va a dormir ve el gen nuevo, o aquí se ve su idle. */
+    __atomic_add_fetch(&ctx->gen, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ctx->idle, __ATOMIC_SEQ_CST) > 0)
+    {
+        pthread_mutex_lock(&ctx->idle_lock);
+        pthread_cond_broadcast(&ctx->idle_cond);
+        pthread_mutex_unlock(&ctx->idle_lock);
+    }
+}
+
+// Retorna: 1 si obtuvo una tarea (propia o robada)
+static int walk_take(struct walk_ctx *ctx, int id, struct walk_task *t)
+{
+    for (int k = 0; k < ctx->nthreads; k++)
+    {
+        struct walk_queue *q = &ctx->queues[(id + k) % ctx->nthreads];
+        int found = 0;
+        pthread_mutex_lock(&q->lock);
+        if (q->tail > q->head)
+        {
+            *t = k == 0 ? q->tasks[--q->tail] : q->tasks[q->head++];
+            if (q->head == q->tail)
+                q->head = q->tail = 0;
+            found = 1;
+        }
+        pthread_mutex_unlock(&q->lock);
+        if (found)
+            return 1;
+    }
+    return 0;
+}
+
+static void walk_fail(struct walk_ctx *ctx, const char *path)
+{
+    fprintf(stderr, "walk: %s: %s\n", path, strerror(errno));
+    __atomic_store_n(&ctx->status, 1, __ATOMIC_RELAXED);
+}
+
+static void walk_flush(struct walk_worker *w)
+{
+    struct walk_ctx *ctx = w->ctx;
+    if (w->len == 0)
+        return;
+    pthread_mutex_lock(&ctx->out_lock);
+    if (!ctx->stop && write_all(ctx->out_fd, w->buf, w->len) != 0)
+    {
+        ctx->stop = 1; // Normalmente EPIPE: nadie lee ya la salida
+        __atomic_store_n(&ctx->status, 1, __ATOMIC_RELAXED);
+    }
+    pthread_mutex_unlock(&ctx->out_lock);
+    w->len = 0;
+}
+
+static void walk_emit(struct walk_worker *w, const char *path, size_t len)
+{
+    if (w->len + len + 1 > WALK_BUF)
+        walk_flush(w);
+    if (len + 1 > WALK_BUF)
+        return; // Imposible en la práctica: open falla antes con ENAMETOOLONG
+    memcpy(w->buf + w->len, path, len);
+    w->buf[w->len + len] = w->ctx->sep;
+    w->len += len + 1;
+}
+
+static int walk_mode_type(unsigned mode)
+{
+    if (S_ISREG(mode))
+        return 'f';
+    if (S_ISDIR(mode))
+        return 'd';
+    if (S_ISLNK(mode))
+        return 'l';
+    return '?';
+}
+
+/*
+Aplica los filtros a una entrada y encola los subdirectorios.
+- type: 'f', 'd', 'l', '?' u 0 si d_type no lo dice (se hace fstatat).
+*/
+static void walk_entry(struct walk_worker *w, int dfd, const char *name, const char *path, size_t len, int type)
+{
+    struct walk_ctx *ctx = w->ctx;
+    struct stat st;
+    int have_st = 0;
+
+    if (type == 0)
+    {
+        if (fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            walk_fail(ctx, path);
+            return;
+        }
+        have_st = 1;
+        type = walk_mode_type(st.st_mode);
+    }
+
+    int match = (!ctx->type || type == ctx->type) &&
+                (!ctx->name || fnmatch(ctx->name, name, 0) == 0);
+    if (match && ctx->newer)
+    {
+        if (!have_st && fstatat(dfd, name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            walk_fail(ctx, path);
+            return;
+        }
+#ifdef __linux__
+        long nsec = st.st_mtim.tv_nsec;
+#else
+        long nsec = 0;
+#endif
+        match = st.st_mtime > ctx->newer_sec || (st.st_mtime == ctx->newer_sec && nsec > ctx->newer_nsec);
+    }
+    if (match)
+        walk_emit(w, path, len);
+    if (type == 'd')
+        walk_push(ctx, w->id, memcpy(xmalloc(len + 1), path, len + 1), len);
+}
+
+#ifdef DT_UNKNOWN
+static int walk_dtype(unsigned char t)
+{
+    switch (t)
+    {
+    case DT_REG:
+        return 'f';
+    case DT_DIR:
+        return 'd';
+    case DT_LNK:
+        return 'l';
+    case DT_UNKNOWN:
+        return 0;
+    default:
+        return '?';
+    }
+}
+#else
+#define walk_dtype(t) 0 // Sin d_type: siempre fstatat
+#endif
+
+// Una entrada de directorio: compone "dir/nombre" sobre el prefijo de *path
+static void walk_child(struct walk_worker *w, int dfd, const char *name, int type,
+                       char **path, size_t *cap, size_t base)
+{
+    if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')))
+        return;
+    size_t nlen = strlen(name);
+    if (base + nlen + 1 > *cap)
+    {
+        *cap = base + nlen + 1;
+        *path = xrealloc(*path, *cap);
+    }
+    memcpy(*path + base, name, nlen + 1);
+    walk_entry(w, dfd, name, *path, base + nlen, type);
+}
+
+// Lista un directorio: filtra sus entradas y encola sus subdirectorios
+static void walk_dir(struct walk_worker *w, const struct walk_task *t)
+{
+    int dfd = openat(AT_FDCWD, t->path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    if (dfd < 0)
+    {
+        walk_fail(w->ctx, t->path);
+        return;
+    }
+
+    // Prefijo "dir/" compartido por todas las entradas
+    size_t base = t->len;
+    size_t cap = base + 258;
+    char *path = xmalloc(cap);
+    memcpy(path, t->path, base);
+    if (base == 0 || path[base - 1] != '/')
+        path[base++] = '/';
+
+#ifdef __linux__
+    while (!__atomic_load_n(&w->ctx->stop, __ATOMIC_RELAXED))
+    {
+        long n = syscall(SYS_getdents64, dfd, w->dents, sizeof(w->dents));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            walk_fail(w->ctx, t->path);
+        if (n <= 0)
+            break;
+        for (long off = 0; off < n;)
+        {
+            struct walk_dirent64 *d = (struct walk_dirent64 *)(w->dents + off);
+            off += d->d_reclen;
+            walk_child(w, dfd, d->d_name, walk_dtype(d->d_type), &path, &cap, base);
+        }
+    }
+    close(dfd);
+#else
+    DIR *dir = fdopendir(dfd);
+    struct dirent *d;
+    if (!dir)
+    {
+        walk_fail(w->ctx, t->path);
+        close(dfd);
+    }
+    else
+    {
+        while (!__atomic_load_n(&w->ctx->stop, __ATOMIC_RELAXED) && (d = readdir(dir)))
+            walk_child(w, dfd, d->d_name, walk_dtype(d->d_type), &path, &cap, base);
+        closedir(dir);
+    }
+#endif
+    free(path);
+}
+
+static void *walk_worker_main(void *arg)
+{
+    struct walk_worker *w = arg;
+    struct walk_ctx *ctx = w->ctx;
+
+    // Como en las etapas en hilo: un lector cerrado da EPIPE, no SIGPIPE
+    sigset_t set, old;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, &old);
+
+    for (;;)
+    {
+        unsigned gen = __atomic_load_n(&ctx->gen, __ATOMIC_SEQ_CST);
+        struct walk_task t;
+        if (walk_take(ctx, w->id, &t))
+        {
+            if (!__atomic_load_n(&ctx->stop, __ATOMIC_RELAXED))
+                walk_dir(w, &t);
+            free(t.path);
+            if (__atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST) == 0)
+            { // Última tarea: despertar a todos para que terminen
+                pthread_mutex_lock(&ctx->idle_lock);
+                pthread_cond_broadcast(&ctx->idle_cond);
+                pthread_mutex_unlock(&ctx->idle_lock);
+            }
+            continue;
+        }
+
+        pthread_mutex_lock(&ctx->idle_lock);
+        __atomic_add_fetch(&ctx->idle, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) > 0 &&
+               __atomic_load_n(&ctx->gen, __ATOMIC_SEQ_CST) == gen)
+            pthread_cond_wait(&ctx->idle_cond, &ctx->idle_lock);
+        __atomic_sub_fetch(&ctx->idle, 1, __ATOMIC_SEQ_CST);
+        int done = __atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) == 0;
+        pthread_mutex_unlock(&ctx->idle_lock);
+        if (done)
+            break;
+    }
+
+    walk_flush(w);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    return NULL;
+}
+
+// Evalúa una raíz (con -name sobre su último componente) y la encola
+static void walk_root(struct walk_worker *w, const char *root)
+{
+    struct walk_ctx *ctx = w->ctx;
+    size_t len = strlen(root);
+    char *name = xstrdup(root);
+    size_t nlen = len;
+    while (nlen > 1 && name[nlen - 1] == '/')
+        name[--nlen] = '\0';
+    char *slash = nlen > 1 ? strrchr(name, '/') : NULL;
+
+    struct stat st;
+    if (fstatat(AT_FDCWD, root, &st, AT_SYMLINK_NOFOLLOW) != 0)
+        walk_fail(ctx, root);
+    else
+        walk_entry(w, AT_FDCWD, slash ? slash + 1 : name, root, len, walk_mode_type(st.st_mode));
+    free(name);
+}
+#endif
+
+static int builtin_walk(char **args)
+{
+#ifdef _WIN32
+    (void)args;
+    fprintf(stderr, "walk: no soportado en Windows\n");
+    return 1;
+#else
+    struct walk_ctx ctx;
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.sep = '\n';
+    int nthreads = 0, nroots = 0;
+    int argc = 0;
+    while (args[argc])
+        argc++;
+    char **roots = xmalloc((argc + 1) * sizeof(char *));
+
+    for (int i = 1; args[i]; i++)
+    {
+        const char *opt = args[i];
+        if (opt[0] != '-' || !opt[1])
+        {
+            roots[nroots++] = args[i];
+            continue;
+        }
+        if (strcmp(opt, "-print0") == 0)
+        {
+            ctx.sep = '\0';
+            continue;
+        }
+        if ((strcmp(opt, "-type") != 0 && strcmp(opt, "-name") != 0 &&
+             strcmp(opt, "-newer") != 0 && strcmp(opt, "-j") != 0) ||
+            !args[i + 1] ||
+            (opt[1] == 't' && (strlen(args[i + 1]) != 1 || !strchr("fdl", args[i + 1][0]))))
+        {
+            fprintf(stderr, "uso: walk [-type f|d|l] [-name PATRÓN] [-newer ARCHIVO] [-print0] [-j N] [DIR...]\n");
+            free(roots);
+            return 2;
+        }
+        const char *val = args[++i];
+        if (opt[1] == 't')
+            ctx.type = val[0];
+        else if (opt[1] == 'j')
+            nthreads = atoi(val);
+        else if (opt[2] == 'a')
+            ctx.name = val;
+        else
+        {
+            struct stat st;
+            if (stat(val, &st) != 0)
+            {
+                fprintf(stderr, "walk: %s: %s\n", val, strerror(errno));
+                free(roots);
+                return 1;
+            }
+            ctx.newer = 1;
+            ctx.newer_sec = st.st_mtime;
+#ifdef __linux__
+            ctx.newer_nsec = st.st_mtim.tv_nsec;
+#endif
+        }
+    }
+    if (nroots == 0)
+        roots[nroots++] = ".";
+
+    if (nthreads <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (int)cpus : 1;
+    }
+    if (nthreads > WALK_MAX_THREADS)
+        nthreads = WALK_MAX_THREADS;
+
+    out_flush(); // Lo que el shell ya tenía pendiente va antes
+    ctx.out_fd = cur_out->fd;
+    ctx.nthreads = nthreads;
+    ctx.queues = xmalloc(nthreads * sizeof(*ctx.queues));
+    struct walk_worker *workers = xmalloc(nthreads * sizeof(*workers));
+    pthread_mutex_init(&ctx.out_lock, NULL);
+    pthread_mutex_init(&ctx.idle_lock, NULL);
+    pthread_cond_init(&ctx.idle_cond, NULL);
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_mutex_init(&ctx.queues[i].lock, NULL);
+        ctx.queues[i].tasks = NULL;
+        ctx.queues[i].head = ctx.queues[i].tail = ctx.queues[i].cap = 0;
+        workers[i].ctx = &ctx;
+        workers[i].id = i;
+        workers[i].len = 0;
+    }
+
+    // Las raíces van a la cola del hilo actual, que hace de trabajador 0
+    for (int i = 0; i < nroots; i++)
+        walk_root(&workers[0], roots[i]);
+
+    int started = 1;
+    while (started < nthreads &&
+           pthread_create(&workers[started].tid, NULL, walk_worker_main, &workers[started]) == 0)
+        started++; // Si falla la creación, los demás roban su parte
+    walk_worker_main(&workers[0]);
+    for (int i = 1; i < started; i++)
+        pthread_join(workers[i].tid, NULL);
+
+    for (int i = 0; i < nthreads; i++)
+    {
+        free(ctx.queues[i].tasks);
+        pthread_mutex_destroy(&ctx.queues[i].lock);
+    }
+    pthread_mutex_destroy(&ctx.out_lock);
+    pthread_mutex_destroy(&ctx.idle_lock);
+    pthread_cond_destroy(&ctx.idle_cond);
+    free(ctx.queues);
+    free(workers);
+    free(roots);
+    return ctx.status;
+#endif
+}
+
+// ------ Comando: fanout ------
+/*
+fanout comando1 [args...] , comando2 [args...] [, ...]
+- Envía una copia de stdin a cada comando, sin procesos 'tee' extra.
+  Uso típico como última etapa: productor | fanout wc -l , sha1sum
+- Linux: cada bloque se mueve con splice() a un pipe intermedio del shell y
+  se duplica con tee() hacia cada consumidor; los datos no salen del núcleo.
+- Si stdin no admite splice (p. ej. una terminal), copia read/write.
+*/
+#ifndef _WIN32
+#define FANOUT_CHUNK (64 * 1024) // Bytes por vuelta (capacidad típica de un pipe)
+
+static pid_t spawn_command(char **args, int in, int out, const int *close_fds, int nclose);
+
+// Envía 'len' bytes al consumidor sin consumirlos de 'mid'
+static int fanout_tee(int mid, int out, size_t len, int scratch[2])
+{
+#ifdef __linux__
+    ssize_t n;
+    STAT_ADD(ST_KCOPIES, 1);
+    while ((n = tee(mid, out, len, 0)) < 0 && errno == EINTR)
+        ;
+    if (n < 0)
+        return -1;
+    if ((size_t)n == len)
+        return 0;
+
+    /* tee() copia en unidades de buffer del pipe y puede quedarse corto si
+       el consumidor va lento; como no admite desplazamiento, se duplica el
+       bloque a 'scratch', se descarta lo ya enviado y se mueve el resto. */
+    char discard[4096];
+    size_t skip = n, rest = len - n;
+    while (tee(mid, scratch[1], len, 0) < 0 && errno == EINTR)
+        ;
+    while (skip > 0)
+    {
+        ssize_t r = sh_read(scratch[0], discard, skip < sizeof(discard) ? skip : sizeof(discard));
+        if (r <= 0)
+            return -1;
+        skip -= r;
+    }
+    while (rest > 0)
+    {
+        n = splice(scratch[0], NULL, out, NULL, rest, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        rest -= n;
+    }
+    return 0;
+#else
+    (void)mid, (void)out, (void)len, (void)scratch;
+    errno = ENOSYS;
+    return -1;
+#endif
+}
+
+// Bucle de copia en el núcleo. Retorna: 1 si stdin no admite splice
+static int fanout_splice(int *outs, int nouts)
+{
+#ifdef __linux__
+    int mid[2], scratch[2];
+    if (pipe2(mid, O_CLOEXEC) < 0)
+        return 1;
+    if (pipe2(scratch, O_CLOEXEC) < 0)
+    {
+        close(mid[0]);
+        close(mid[1]);
+        return 1;
+    }
+
+    int rc = 0;
+    for (;;)
+    {
+        STAT_ADD(ST_KCOPIES, 1);
+        ssize_t len = splice(cur_in, NULL, mid[1], NULL, FANOUT_CHUNK, SPLICE_F_MOVE);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len < 0)
+        {
+            rc = errno == EINVAL ? 1 : -1;
+            break;
+        }
+        if (len == 0)
+            break;
+
+        // Todos menos el último reciben una copia; el último se queda el bloque
+        int last = -1;
+        for (int i = 0; i < nouts; i++)
+        {
+            if (outs[i] < 0)
+                continue;
+            if (last >= 0 && fanout_tee(mid[0], outs[last], len, scratch) != 0)
+            {
+                close(outs[last]); // Consumidor cerrado (EPIPE): se descarta
+                outs[last] = -1;
+            }
+            last = i;
+        }
+
+        size_t rest = len;
+        while (rest > 0)
+        {
+            int dst = last >= 0 ? outs[last] : -1;
+            STAT_ADD(ST_KCOPIES, 1);
+            ssize_t n = dst >= 0 ? splice(mid[0], NULL, dst, NULL, rest, SPLICE_F_MOVE) : -1;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            { // Nadie más escucha: vaciar el pipe intermedio
+                if (dst >= 0)
+                {
+                    close(dst);
+                    outs[last] = -1;
+                }
+                char sink[4096];
+                while (rest > 0 && (n = sh_read(mid[0], sink, rest < sizeof(sink) ? rest : sizeof(sink))) > 0)
+                    rest -= n;
+                break;
+            }
+            rest -= n;
+        }
+    }
+
+    close(mid[0]);
+    close(mid[1]);
+    close(scratch[0]);
+    close(scratch[1]);
+    return rc;
+#else
+    (void)outs, (void)nouts;
+    return 1;
+#endif
+}
+
+static void fanout_copy(int *outs, int nouts)
+{
+    char *buf = xmalloc(COPY_BLOCK);
+    ssize_t n;
+    while ((n = sh_read(cur_in, buf, COPY_BLOCK)) > 0 || (n < 0 && errno == EINTR))
+    {
+        for (int i = 0; i < nouts; i++)
+        {
+            if (n > 0 && outs[i] >= 0 && write_all(outs[i], buf, n) != 0)
+            {
+                close(outs[i]);
+                outs[i] = -1;
+            }
+        }
+    }
+    free(buf);
+}
+#endif
+
+static int builtin_fanout(char **args)
+{
+#ifdef _WIN32
+    (void)args;
+    fprintf(stderr, "fanout: no soportado en Windows\n");
+    return 1;
+#else
+    int nouts = 0;
+    for (int i = 1; args[i]; i++)
+    {
+        if (strcmp(args[i], ",") == 0 || !args[i + 1])
+            nouts++;
+    }
+    if (!args[1] || nouts == 0)
+    {
+        fprintf(stderr, "uso: fanout comando [args...] , comando [args...]\n");
+        return 2;
+    }
+
+    int *outs = xmalloc(nouts * sizeof(int));
+    pid_t *pids = xmalloc(nouts * sizeof(pid_t));
+    int n = 0, status = 0;
+    char **cmd = &args[1];
+
+    for (int i = 1;; i++)
+    {
+        int at_end = !args[i];
+        if (!at_end && strcmp(args[i], ",") != 0)
+            continue;
+
+        args[i] = NULL; // Cortar el comando en la coma
+        int fds[2];
+        if (!cmd[0] || pipe2(fds, O_CLOEXEC) < 0)
+        {
+            fprintf(stderr, "fanout: comando vacío o sin pipes\n");
+            status = 2;
+            break;
+        }
+        outs[n] = fds[1];
+        pids[n] = spawn_command(cmd, fds[0], -1, outs, n + 1); // Sin heredar ningún extremo de escritura
+        close(fds[0]);
+        n++;
+        if (at_end)
+            break;
+        cmd = &args[i + 1];
+    }
+
+    if (status == 0)
+    {
+        void (*old)(int) = signal(SIGPIPE, SIG_IGN); // Un consumidor puede cerrar antes
+        if (fanout_splice(outs, n) == 1)
+            fanout_copy(outs, n);
+        signal(SIGPIPE, old);
+    }
+
+    for (int i = 0; i < n; i++)
+    {
+        if (outs[i] >= 0)
+            close(outs[i]);
+    }
+    for (int i = 0; i < n; i++)
+    {
+        int wstatus;
+        if (pids[i] > 0 && waitpid(pids[i], &wstatus, 0) == pids[i] &&
+            (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0))
+            status = WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus);
+    }
+
+    free(outs);
+    free(pids);
+    return status;
+#endif
+}
+
+// ------ Comando: printf ------
+/*
+printf [-v VAR] FORMATO [ARGUMENTOS...]
+- Directivas %s %b %c %d %i %u %o %x %X %e %E %f %F %g %G y %%, con
+  indicadores, ancho y precisión (también '*'); escapes \n \t \\ \0NNN \xHH...
+- El formato se repite mientras queden argumentos (como en sh).
+- Cada formato distinto se analiza una vez y se guarda ya compilado (lista
+  de directivas) en una caché del hilo principal; las etapas de tubería en
+  hilo lo compilan para su invocación.
+- Escribe en el buffer de salida del shell, o en VAR con -v.
+*/
+#define PRINTF_CACHE 64 // Formatos compilados que se conservan
+
+struct pf_directive
+{
+    char conv;     // 0 = texto literal
+    char spec[32]; // Formato de snprintf para un solo valor ("%-8.2lld")
+    int star;      // Bits: 1 = ancho '*', 2 = precisión '*'
+    size_t off, len; // Texto literal dentro de pf_format.text
+};
+
+struct pf_format
+{
+    char *key; // Formato original
+    char *text; // Literales con los escapes ya resueltos
+    struct pf_directive *dirs;
+    size_t ndirs;
+    int nconv; // Directivas que consumen argumentos
+};
+
+static struct pf_format *pf_cache[PRINTF_CACHE];
+
+// Resuelve el escape que empieza en s[0] == '\\'. Retorna: caracteres consumidos
+static size_t pf_escape(const char *s, struct strbuf *out)
+{
+    static const char from[] = "abfnrtv\\\"'", to[] = "\a\b\f\n\r\t\v\\\"'";
+    const char *hit = s[1] ? strchr(from, s[1]) : NULL;
+    size_t n = 1;
+    int c = 0;
+
+    if (hit)
+    {
+        sb_putc(out, to[hit - from]);
+        return 2;
+    }
+    if (s[1] == 'x' && isxdigit((unsigned char)s[2]))
+    {
+        for (n = 2; n < 4 && isxdigit((unsigned char)s[n]); n++)
+            c = c * 16 + (isdigit((unsigned char)s[n]) ? s[n] - '0' : (tolower((unsigned char)s[n]) - 'a' + 10));
+        sb_putc(out, (char)c);
+        return n;
+    }
+    if (s[1] >= '0' && s[1] <= '7')
+    { // \NNN o \0NNN
+        size_t start = s[1] == '0' ? 2 : 1;
+        for (n = start; n < start + 3 && s[n] >= '0' && s[n] <= '7'; n++)
+            c = c * 8 + (s[n] - '0');
+        sb_putc(out, (char)c);
+        return n;
+    }
+    sb_putc(out, '\\'); // Escape desconocido: se deja tal cual
+    return 1;
+}
+
+static void pf_free(struct pf_format *f)
+{
+    if (!f)
+        return;
+    free(f->key);
+    free(f->text);
+    free(f->dirs);
+    free(f);
+}
+
+// Analiza el formato. Retorna: NULL (con el error en stderr) si es inválido
+static struct pf_format *pf_compile(const char *fmt)
+{
+    struct pf_format *f = xmalloc(sizeof(*f));
+    struct strbuf text = {0};
+    size_t cap = 8;
+    const char *p = fmt;
+
+    memset(f, 0, sizeof(*f));
+    f->dirs = xmalloc(cap * sizeof(*f->dirs));
+    while (*p)
+    {
+        struct pf_directive d = {0};
+        if (f->ndirs == cap)
+        {
+            cap *= 2;
+            f->dirs = xrealloc(f->dirs, cap * sizeof(*f->dirs));
+        }
+
+        if (*p != '%' || p[1] == '%')
+        { // Texto literal hasta la próxima directiva
+            d.off = text.len;
+            while (*p && (*p != '%' || p[1] == '%'))
+            {
+                if (*p == '%')
+                {
+                    sb_putc(&text, '%');
+                    p += 2;
+                }
+                else if (*p == '\\')
+                    p += pf_escape(p, &text);
+                else
+                    sb_putc(&text, *p++);
+            }
+            d.len = text.len - d.off;
+            f->dirs[f->ndirs++] = d;
+            continue;
+        }
+
+        // %[indicadores][ancho][.precisión][longitud]conversión
+        const char *start = p++;
+        size_t n = 0;
+        d.spec[n++] = '%';
+        while (*p && strchr("-+ #0", *p) && n < 8)
+            d.spec[n++] = *p++;
+        if (*p == '*')
+        {
+            d.star |= 1;
+            d.spec[n++] = *p++;
+        }
+        while (isdigit((unsigned char)*p) && n < 14)
+            d.spec[n++] = *p++;
+        if (*p == '.')
+        {
+            d.spec[n++] = *p++;
+            if (*p == '*')
+            {
+                d.star |= 2;
+                d.spec[n++] = *p++;
+            }
+            while (isdigit((unsigned char)*p) && n < 22)
+                d.spec[n++] = *p++;
+        }
+        while (*p && strchr("hlLqjzt", *p))
+            p++; // Los modificadores de longitud se ignoran: todo es 64 bits
+
+        if (!*p || !strchr("sbcdiuoxXeEfFgGaA", *p) || isdigit((unsigned char)*p))
+        {
+            fprintf(stderr, "printf: %.*s: directiva inválida\n", (int)(p - start + (*p != 0)), start);
+            free(text.data);
+            pf_free(f);
+            return NULL;
+        }
+        d.conv = *p++;
+        if (strchr("diuoxX", d.conv))
+        {
+            d.spec[n++] = 'l';
+            d.spec[n++] = 'l';
+        }
+        d.spec[n++] = d.conv == 'b' ? 's' : d.conv;
+        d.spec[n] = '\0';
+        f->nconv++;
+        f->dirs[f->ndirs++] = d;
+    }
+
+    f->key = xstrdup(fmt);
+    f->text = text.data ? text.data : xstrdup("");
+    return f;
+}
+
+// Formato compilado (de la caché si es el hilo principal; si no, hay que liberarlo)
+static struct pf_format *pf_lookup(const char *fmt, int *owned)
+{
+    size_t slot = var_hash(fmt, strlen(fmt)) % PRINTF_CACHE;
+    struct pf_format *f;
+
+    *owned = cur_out != &main_out; // Hilo de tubería: sin caché compartida
+    if (!*owned && pf_cache[slot] && strcmp(pf_cache[slot]->key, fmt) == 0)
+        return pf_cache[slot];
+
+    f = pf_compile(fmt);
+    if (f && !*owned)
+    {
+        pf_free(pf_cache[slot]);
+        pf_cache[slot] = f;
+    }
+    return f;
+}
+
+// Valor numérico de un argumento ('c toma el código del carácter)
+static int64_t pf_number(const char *arg)
+{
+    if (*arg == '\'' || *arg == '"')
+        return (unsigned char)arg[1];
+    return strtoll(arg, NULL, 0);
+}
+
+static void pf_put(struct strbuf *sb, const char *s, size_t len)
+{
+    if (sb)
+        sb_append(sb, s, len);
+    else
+        out_write(s, len);
+}
+
+/*
+Aplica el formato una vez consumiendo argumentos desde *argi.
+- sb: destino de -v, o NULL para la salida del shell.
+*/
+static void pf_run(const struct pf_format *f, char **args, int *argi, struct strbuf *sb)
+{
+    char tmp[256];
+
+    for (size_t i = 0; i < f->ndirs; i++)
+    {
+        const struct pf_directive *d = &f->dirs[i];
+        char spec[64];
+        const char *use = d->spec;
+        int n;
+
+        if (!d->conv)
+        {
+            pf_put(sb, f->text + d->off, d->len);
+            continue;
+        }
+
+        if (d->star)
+        { // Sustituir cada '*' por el número del argumento correspondiente
+            size_t o = 0;
+            for (const char *c = d->spec; *c && o < sizeof(spec) - 24; c++)
+            {
+                if (*c == '*')
+                {
+                    int v = (int)pf_number(args[*argi] ? args[(*argi)++] : "0");
+                    o += snprintf(spec + o, sizeof(spec) - o, "%d", v);
+                }
+                else
+                    spec[o++] = *c;
+            }
+            spec[o] = '\0';
+            use = spec;
+        }
+
+        const char *arg = args[*argi] ? args[(*argi)++] : NULL;
+        struct strbuf esc = {0};
+        char *out = tmp;
+        switch (d->conv)
+        {
+        case 's':
+            n = snprintf(tmp, sizeof(tmp), use, arg ? arg : "");
+            break;
+        case 'b':
+            for (const char *c = arg ? arg : ""; *c;)
+            {
+                if (*c == '\\')
+                    c += pf_escape(c, &esc);
+                else
+                    sb_putc(&esc, *c++);
+            }
+            n = snprintf(tmp, sizeof(tmp), use, esc.data ? esc.data : "");
+            break;
+        case 'c':
+            n = arg && *arg ? snprintf(tmp, sizeof(tmp), use, *arg) : 0; // Sin carácter: nada
+            break;
+        case 'd':
+        case 'i':
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            n = snprintf(tmp, sizeof(tmp), use, (long long)(arg ? pf_number(arg) : 0));
+            break;
+        default:
+            n = snprintf(tmp, sizeof(tmp), use, arg ? strtod(arg, NULL) : 0.0);
+            break;
+        }
+
+        if (n >= (int)sizeof(tmp))
+        { // No cabía en el buffer local: repetir con uno del tamaño justo
+            out = xmalloc(n + 1);
+            if (d->conv == 's')
+                snprintf(out, n + 1, use, arg ? arg : "");
+            else if (d->conv == 'b')
+                snprintf(out, n + 1, use, esc.data ? esc.data : "");
+            else if (strchr("diuoxX", d->conv))
+                snprintf(out, n + 1, use, (long long)(arg ? pf_number(arg) : 0));
+            else
+                snprintf(out, n + 1, use, arg ? strtod(arg, NULL) : 0.0);
+        }
+        if (n > 0)
+            pf_put(sb, out, n);
+        if (out != tmp)
+            free(out);
+        free(esc.data);
+    }
+}
+
+static int builtin_printf(char **args)
+{
+    const char *var = NULL;
+    struct strbuf sb = {0};
+    int first = 1, owned;
+
+    if (args[1] && strcmp(args[1], "-v") == 0)
+    {
+        var = args[2];
+        first = 3;
+        if (!var || !valid_name(var))
+        {
+            fprintf(stderr, "printf: -v necesita un nombre de variable válido\n");
+            return 2;
+        }
+    }
+    if (!args[first])
+    {
+        fprintf(stderr, "uso: printf [-v VAR] FORMATO [ARGUMENTOS...]\n");
+        return 2;
+    }
+
+    struct pf_format *f = pf_lookup(args[first], &owned);
+    if (!f)
+        return 1;
+
+    int argi = first + 1;
+    do
+        pf_run(f, args, &argi, var ? &sb : NULL);
+    while (args[argi] && f->nconv > 0);
+
+    if (var)
+    {
+        var_assign(var, sb.data ? sb.data : "");
+        free(sb.data);
+    }
+    if (owned)
+        pf_free(f);
+    return 0;
+}
+
+// ------ Comando: [[ ------
+/*
+[[ EXPRESIÓN ]]
+- Cadenas: -z S, -n S, S, S == PATRÓN, S != PATRÓN (patrón glob), S < T, S > T.
+- Enteros: -eq -ne -lt -le -gt -ge.
+- Archivos: -e -f -d -L/-h -p -S -b -c -s -r -w -x, A -nt B, A -ot B,
+  A -ef B (con la caché de stat de la línea).
+- test EXPRESIÓN y [ EXPRESIÓN ] usan el mismo evaluador con -a/-o.
+- S =~ ERE: expresión regular extendida; BASH_REMATCH recibe la
+  coincidencia completa y los grupos.
+- Se combinan con !, &&, || y paréntesis.
+- Las expresiones regulares compiladas se guardan en una caché LRU por texto
+  del patrón. Los patrones sin metacaracteres (salvo ^ y $ en los extremos)
+  no pasan por regcomp/regexec: se resuelven con strstr/memcmp.
+- Retorna: 0 si es cierta, 1 si no, 2 si hay un error de sintaxis.
+*/
+#define REGEX_CACHE 32 // Expresiones regulares compiladas que se conservan
+
+#ifndef _WIN32
+struct regex_entry
+{
+    char *pattern; // NULL = libre
+    regex_t re;
+    unsigned long last_use; // Para expulsar la menos usada recientemente
+};
+
+static struct regex_entry regex_cache[REGEX_CACHE];
+static unsigned long regex_tick = 0;
+
+// Expresión compilada para 'pattern' (NULL con el error en stderr si no compila)
+static regex_t *regex_lookup(const char *pattern)
+{
+    struct regex_entry *victim = &regex_cache[0];
+
+    for (int i = 0; i < REGEX_CACHE; i++)
+    {
+        struct regex_entry *e = &regex_cache[i];
+        if (e->pattern && strcmp(e->pattern, pattern) == 0)
+        {
+            e->last_use = ++regex_tick;
+            return &e->re;
+        }
+        if (!e->pattern || (victim->pattern && e->last_use < victim->last_use))
+            victim = e;
+    }
+
+    regex_t re;
+    int err = regcomp(&re, pattern, REG_EXTENDED);
+    if (err != 0)
+    {
+        char msg[128];
+        regerror(err, &re, msg, sizeof(msg));
+        fprintf(stderr, "shell: [[ =~ %s ]]: %s\n", pattern, msg);
+        return NULL;
+    }
+    if (victim->pattern)
+    {
+        regfree(&victim->re);
+        free(victim->pattern);
+    }
+    victim->pattern = xstrdup(pattern);
+    victim->re = re;
+    victim->last_use = ++regex_tick;
+    return &victim->re;
+}
+#endif
+
+// S =~ PATRÓN. Retorna: 0 si coincide, 1 si no, 2 si el patrón no es válido
+static int cond_regex(const char *s, const char *pattern)
+{
+    size_t plen = strlen(pattern), slen = strlen(s);
+    int head = plen > 0 && pattern[0] == '^';
+    int tail = plen > (size_t)head && pattern[plen - 1] == '$' && (plen < 2 || pattern[plen - 2] != '\\');
+    const char *lit = pattern + head;
+    size_t llen = plen - head - tail;
+
+    // Vía rápida: literal, con ancla opcional al principio y/o al final
+    if (strcspn(lit, ".[]()*+?{}|\\^$") >= llen)
+    {
+        const char *at = NULL;
+        if (head && tail)
+            at = llen == slen && memcmp(s, lit, llen) == 0 ? s : NULL;
+        else if (head)
+            at = llen <= slen && memcmp(s, lit, llen) == 0 ? s : NULL;
+        else if (tail)
+            at = llen <= slen && memcmp(s + slen - llen, lit, llen) == 0 ? s + slen - llen : NULL;
+        else
+        {
+            char *key = memcpy(xmalloc(llen + 1), lit, llen);
+            key[llen] = '\0';
+            at = strstr(s, key);
+            free(key);
+        }
+        if (!at)
+        {
+            var_set_words("BASH_REMATCH", NULL, 0);
+            return 1;
+        }
+        char *match = memcpy(xmalloc(llen + 1), at, llen);
+        match[llen] = '\0';
+        var_set_scalar("BASH_REMATCH", match);
+        free(match);
+        return 0;
+    }
+
+#ifdef _WIN32
+    fprintf(stderr, "shell: [[ =~ ]]: solo hay patrones literales en Windows\n");
+    return 2;
+#else
+    regex_t *re = regex_lookup(pattern);
+    if (!re)
+        return 2;
+
+    size_t ngroups = re->re_nsub + 1;
+    regmatch_t *m = xmalloc(ngroups * sizeof(regmatch_t));
+    int status = regexec(re, s, ngroups, m, 0) == 0 ? 0 : 1;
+    if (status == 0)
+    { // BASH_REMATCH[0] = coincidencia, [i] = grupo i ("" si no participó)
+        char **words = xmalloc(ngroups * sizeof(char *));
+        for (size_t i = 0; i < ngroups; i++)
+        {
+            size_t len = m[i].rm_so < 0 ? 0 : (size_t)(m[i].rm_eo - m[i].rm_so);
+            words[i] = memcpy(xmalloc(len + 1), s + (m[i].rm_so < 0 ? 0 : m[i].rm_so), len);
+            words[i][len] = '\0';
+        }
+        var_set_words("BASH_REMATCH", (const char **)words, ngroups);
+        for (size_t i = 0; i < ngroups; i++)
+            free(words[i]);
+        free(words);
+    }
+    else
+        var_set_words("BASH_REMATCH", NULL, 0);
+    free(m);
+    return status;
+#endif
+}
+
+struct cond_parser
+{
+    char **args;
+    int pos;
+    int error;
+    int posix; // test/[: -a y -o también son "y"/"o"
+    int skip;  // Lado de &&/|| que no cuenta: solo se analiza
+};
+
+// Pruebas de archivo de un operando (-f RUTA...). Retorna: -1 si 'op' no es una
+static int file_test(const char *op, const char *path)
+{
+    struct stat_entry *e;
+
+    switch (op[1])
+    {
+    case 'r':
+        return access_cached(path, R_OK);
+    case 'w':
+        return access_cached(path, W_OK);
+    case 'x':
+        return access_cached(path, X_OK);
+    case 'e':
+    case 'a':
+        return !stat_cached(path, 0, SF_TYPE)->err;
+    case 's':
+        e = stat_cached(path, 0, SF_TYPE | SF_SIZE);
+        return !e->err && e->size > 0;
+#ifndef _WIN32
+    case 'L':
+    case 'h':
+        e = stat_cached(path, 1, SF_TYPE);
+        return !e->err && S_ISLNK(e->mode);
+#endif
+    }
+
+    e = stat_cached(path, 0, SF_TYPE);
+    if (e->err)
+        return strchr("fdpSbc", op[1]) ? 0 : -1;
+    switch (op[1])
+    {
+    case 'f':
+        return S_ISREG(e->mode);
+    case 'd':
+        return S_ISDIR(e->mode);
+#ifndef _WIN32
+    case 'p':
+        return S_ISFIFO(e->mode);
+    case 'S':
+        return S_ISSOCK(e->mode);
+    case 'b':
+        return S_ISBLK(e->mode);
+#endif
+    case 'c':
+        return S_ISCHR(e->mode);
+    }
+    return -1;
+}
+
+// A -nt B, A -ot B, A -ef B
+static int file_compare(const char *a, const char *op, const char *b)
+{
+    unsigned fields = op[1] == 'e' ? SF_TYPE | SF_INO : SF_TYPE | SF_MTIME;
+    struct stat_entry ea = *stat_cached(a, 0, fields); // Copia: la segunda puede reemplazarla
+    struct stat_entry *eb = stat_cached(b, 0, fields);
+
+    if (op[1] == 'e')
+        return !ea.err && !eb->err && ea.dev == eb->dev && ea.ino == eb->ino;
+    if (ea.err || eb->err) // El que existe es el más nuevo
+        return op[1] == 'n' ? !ea.err && eb->err : ea.err && !eb->err;
+    int cmp = ea.mtime_sec != eb->mtime_sec ? (ea.mtime_sec > eb->mtime_sec ? 1 : -1)
+                                            : (ea.mtime_nsec > eb->mtime_nsec) - (ea.mtime_nsec < eb->mtime_nsec);
+    return op[1] == 'n' ? cmp > 0 : cmp < 0;
+}
+
+static const char *cond_peek(struct cond_parser *cp)
+{
+    return cp->args[cp->pos];
+}
+
+static int cond_or(struct cond_parser *cp);
+
+// El token cierra un operando (o no hay más)
+static int cond_stop(const struct cond_parser *cp, const char *t)
+{
+    if (t && cp->posix && (!strcmp(t, "-a") || !strcmp(t, "-o") || !strcmp(t, "]")))
+        return 1;
+    return !t || !strcmp(t, "]]") || !strcmp(t, "&&") || !strcmp(t, "||") || !strcmp(t, ")");
+}
+
+// Entero de -eq/-lt/...: el texto completo debe ser un número
+static int cond_int(struct cond_parser *cp, const char *s, int64_t *out)
+{
+    if (!parse_int(s, strlen(s), out))
+    {
+        fprintf(stderr, "shell: %s: se esperaba un entero\n", s);
+        cp->error = 1;
+        return 0;
+    }
+    return 1;
+}
+
+static int cond_primary(struct cond_parser *cp)
+{
+    static const char *int_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    const char *a = cond_peek(cp), *op, *b;
+
+    if (!a)
+    {
+        cp->error = 1;
+        return 0;
+    }
+    if (strcmp(a, "(") == 0)
+    {
+        cp->pos++;
+        int v = cond_or(cp);
+        if (!cond_peek(cp) || strcmp(cond_peek(cp), ")") != 0)
+            cp->error = 1;
+        cp->pos++;
+        return v;
+    }
+
+    op = cp->args[cp->pos + 1];
+    if (a[0] == '-' && a[1] && !a[2] && !cond_stop(cp, op) && cond_stop(cp, cp->args[cp->pos + 2]))
+    { // Operador unario: -z S, -n S y las pruebas de archivo
+        cp->pos += 2;
+        if (cp->skip)
+        { // Sin evaluar, pero un operador desconocido sigue siendo un error
+            if (!strchr("znrwxeasLhfdpSbc", a[1]))
+            {
+                fprintf(stderr, "shell: %s: operador desconocido\n", a);
+                cp->error = 1;
+            }
+            return 0;
+        }
+        if (a[1] == 'z')
+            return !*op;
+        if (a[1] == 'n')
+            return *op != 0;
+        int v = file_test(a, op);
+        if (v < 0)
+        {
+            fprintf(stderr, "shell: %s: operador desconocido\n", a);
+            cp->error = 1;
+            return 0;
+        }
+        return v;
+    }
+
+    b = op ? cp->args[cp->pos + 2] : NULL;
+    if (cond_stop(cp, op) || !b)
+    { // Palabra sola: cierta si no está vacía
+        cp->pos++;
+        return *a != 0;
+    }
+    cp->pos += 3;
+
+    if (cp->skip)
+    {
+        int known = !strcmp(op, "==") || !strcmp(op, "=") || !strcmp(op, "!=") || !strcmp(op, "<") ||
+                    !strcmp(op, ">") || !strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef") ||
+                    !strcmp(op, "=~");
+        for (int i = 0; i < 6 && !known; i++)
+            known = strcmp(op, int_ops[i]) == 0;
+        if (!known)
+        {
+            fprintf(stderr, "shell: %s: operador binario desconocido\n", op);
+            cp->error = 1;
+        }
+        return 0;
+    }
+    if (strcmp(op, "==") == 0 || strcmp(op, "=") == 0 || strcmp(op, "!=") == 0)
+    {
+#ifdef _WIN32
+        int match = strcmp(a, b) == 0;
+#else
+        // Patrones solo en [[ ]]: en test/[ es comparación de texto
+        int match = cp->posix ? strcmp(a, b) == 0 : fnmatch(b, a, 0) == 0;
+#endif
+        return op[0] == '!' ? !match : match;
+    }
+    if (strcmp(op, "<") == 0)
+        return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0)
+        return strcmp(a, b) > 0;
+    if (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef"))
+        return file_compare(a, op, b);
+    if (strcmp(op, "=~") == 0)
+    {
+        int r = cond_regex(a, b);
+        cp->error |= r == 2;
+        return r == 0;
+    }
+    for (int i = 0; i < 6; i++)
+    {
+        int64_t x, y;
+        if (strcmp(op, int_ops[i]) != 0)
+            continue;
+        if (!cond_int(cp, a, &x) || !cond_int(cp, b, &y))
+            return 0;
+        switch (i)
+        {
+        case 0:
+            return x == y;
+        case 1:
+            return x != y;
+        case 2:
+            return x < y;
+        case 3:
+            return x <= y;
+        case 4:
+            return x > y;
+        default:
+            return x >= y;
+        }
+    }
+    fprintf(stderr, "shell: %s: operador binario desconocido\n", op);
+    cp->error = 1;
+    return 0;
+}
+
+static int cond_not(struct cond_parser *cp)
+{
+    if (cond_peek(cp) && strcmp(cond_peek(cp), "!") == 0)
+    {
+        cp->pos++;
+        return !cond_not(cp);
+    }
+    return cond_primary(cp);
+}
+
+/*
+&& y || en cortocircuito: el lado que ya no decide se analiza con skip
+(sintaxis completa, sin stat, sin enteros ni BASH_REMATCH).
+*/
+static int cond_and(struct cond_parser *cp)
+{
+    int v = cond_not(cp);
+    while (!cp->error && cond_peek(cp) &&
+           (!strcmp(cond_peek(cp), "&&") || (cp->posix && !strcmp(cond_peek(cp), "-a"))))
+    {
+        int skip = cp->skip;
+        cp->pos++;
+        cp->skip |= !v;
+        int r = cond_not(cp);
+        cp->skip = skip;
+        v = v && r;
+    }
+    return v;
+}
+
+static int cond_or(struct cond_parser *cp)
+{
+    int v = cond_and(cp);
+    while (!cp->error && cond_peek(cp) &&
+           (!strcmp(cond_peek(cp), "||") || (cp->posix && !strcmp(cond_peek(cp), "-o"))))
+    {
+        int skip = cp->skip;
+        cp->pos++;
+        cp->skip |= v;
+        int r = cond_and(cp);
+        cp->skip = skip;
+        v = v || r;
+    }
+    return v;
+}
+
+/*
+Pide en lote las rutas de las pruebas de archivo de la expresión antes de
+evaluarla: "[[ -f a && -f b && b -nt c ]]" hace un solo envío.
+- Se mira solo la forma (operador y su operando); si el texto resulta ser
+  otra cosa, el stat de sobra no tiene efectos.
+*/
+static void cond_prefetch(char **args, const char *end)
+{
+    struct stat_want want[STAT_CACHE / 2];
+    int n = 0;
+
+    for (int i = 0; args[i] && args[i + 1] && n + 2 <= STAT_CACHE / 2; i++)
+    {
+        const char *op = args[i], *next = args[i + 1];
+        if (op[0] != '-' || (end && strcmp(next, end) == 0))
+            continue;
+        if (op[1] && !op[2] && strchr("erwxasfdpSbcLh", op[1]))
+        {
+            int link = op[1] == 'L' || op[1] == 'h';
+            want[n++] = (struct stat_want){next, link, op[1] == 's' ? SF_TYPE | SF_SIZE : SF_TYPE};
+        }
+        else if (i > 0 && (!strcmp(op, "-nt") || !strcmp(op, "-ot") || !strcmp(op, "-ef")))
+        {
+            unsigned fields = op[1] == 'e' ? SF_TYPE | SF_INO : SF_TYPE | SF_MTIME;
+            want[n++] = (struct stat_want){args[i - 1], 0, fields};
+            want[n++] = (struct stat_want){next, 0, fields};
+        }
+    }
+    if (n > 1)
+        stat_prefetch(want, n);
+}
+
+/*
+Evalúa args[0..] hasta 'end' (NULL, o el texto que cierra: "]]" o "]").
+- posix: sintaxis de test/[ (-a, -o).
+- Retorna: 0 si es cierta, 1 si no, 2 si hay un error.
+*/
+static int cond_eval(char **args, const char *end, int posix)
+{
+    struct cond_parser cp = {args, 0, 0, posix, 0};
+    cond_prefetch(args, end);
+    int v = cond_or(&cp);
+    const char *rest = cond_peek(&cp);
+
+    if (!cp.error && (end ? !rest || strcmp(rest, end) != 0 || cp.args[cp.pos + 1] : rest != NULL))
+    {
+        if (rest)
+            fprintf(stderr, "shell: %s: error de sintaxis en la condición\n", rest);
+        else
+            fprintf(stderr, "shell: falta '%s'\n", end);
+        cp.error = 1;
+    }
+    return cp.error ? 2 : !v;
+}
+
+static int builtin_cond(char **args)
+{
+    return cond_eval(args + 1, "]]", 0);
+}
+
+// test EXPRESIÓN / [ EXPRESIÓN ]
+static int builtin_test(char **args)
+{
+    int bracket = strcmp(args[0], "[") == 0;
+    if (!args[1] || (bracket && !strcmp(args[1], "]") && !args[2]))
+        return 1; // Sin expresión: falso
+    return cond_eval(args + 1, bracket ? "]" : NULL, 1);
+}
+
+// ------ Comando: export ------
+/*
+export NOMBRE[=VALOR]...
+- Asigna (si hay VALOR) y marca la variable como exportada: su valor se
+  copia al entorno ahora y, si cambia después (asignación o aritmética),
+  otra vez antes de crear el siguiente proceso (env_sync).
+*/
+static int builtin_export(char **args)
+{
+    int status = 0;
+
+    for (int i = 1; args[i]; i++)
+    {
+        char *eq = assignment(args[i]);
+        if (eq)
+        {
+            *eq = '\0';
+            var_assign(args[i], eq + 1);
+        }
+        else if (!valid_name(args[i]))
+        {
+            fprintf(stderr, "export: %s: nombre inválido\n", args[i]);
+            status = 1;
+            continue;
+        }
+
+        struct var *v = var_lookup(args[i], strlen(args[i]));
+        if (!v)
+        { // Sin valor: heredar el del entorno si lo hay, como sh
+            const char *env = getenv(args[i]);
+            if (env)
+                var_assign(args[i], env);
+            v = var_lookup(args[i], strlen(args[i]));
+        }
+        if (!v)
+            v = var_get(args[i]); // Exportada sin valor: entra al entorno al asignarla
+        v->exported = 1;
+        v->env_stale = env_dirty = 1;
+        env_sync();
+        state_gen++; // El zygote tiene que ver el nuevo entorno
+        if (eq)
+            *eq = '=';
+    }
+    return status;
+}
+
+// ------ Comando: stats ------
+/*
+stats
+- Muestra los contadores del comando anterior y de toda la sesión.
+*/
+static uint64_t cmd_stats[ST_COUNT]; // Diferencia del último comando (run_line)
+
+static int builtin_stats(char **args)
+{
+    (void)args;
+    out_printf("%-16s %14s %14s\n", "contador", "anterior", "sesión");
+    for (int i = 0; i < ST_COUNT; i++)
+    {
+        out_printf("%-16s %14llu %14llu\n", stat_names[i],
+                   (unsigned long long)cmd_stats[i],
+                   (unsigned long long)__atomic_load_n(&stats[i], __ATOMIC_RELAXED));
+    }
+    return 0;
+}
+
+void stats_dump_json(FILE *f)
+{
+    fprintf(f, "{\"session\": {");
+    for (int i = 0; i < ST_COUNT; i++)
+        fprintf(f, "%s\"%s\": %llu", i ? ", " : "", stat_names[i], (unsigned long long)stats[i]);
+    fprintf(f, "}, \"last_command\": {");
+    for (int i = 0; i < ST_COUNT; i++)
+        fprintf(f, "%s\"%s\": %llu", i ? ", " : "", stat_names[i], (unsigned long long)cmd_stats[i]);
+    fprintf(f, "}, \"resources\": {\"wall_us\": %llu", (unsigned long long)(now_us() - session_t0));
+#ifndef _WIN32
+    // Shell más hijos ya recogidos: lo que costó el script completo
+    struct rusage self, kids;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &kids);
+    fprintf(f, ", \"user_us\": %lld, \"sys_us\": %lld, \"max_rss_kb\": %ld",
+            (long long)(self.ru_utime.tv_sec + kids.ru_utime.tv_sec) * 1000000 +
+                self.ru_utime.tv_usec + kids.ru_utime.tv_usec,
+            (long long)(self.ru_stime.tv_sec + kids.ru_stime.tv_sec) * 1000000 +
+                self.ru_stime.tv_usec + kids.ru_stime.tv_usec,
+            self.ru_maxrss > kids.ru_maxrss ? self.ru_maxrss : kids.ru_maxrss);
+#endif
+    fprintf(f, "}}\n");
+}
+
+/*
+BI_THREAD: el builtin no toca el estado del shell (variables, directorio,
+descriptores globales) y solo usa cur_in/cur_out, así que puede correr
+como etapa de una tubería en un hilo en lugar de en un proceso hijo.
+*/
+#define BI_THREAD 1
+
+/*
+BI_FS: el builtin puede lanzar procesos o cambiar el directorio, así que
+invalida la caché de stat de las pruebas de archivo al terminar.
+*/
+#define BI_FS 2
+
+struct builtin
+{
+    const char *name;
+    int (*fn)(char **args);
+    int flags;
+};
+
+static const struct builtin builtins[] = {
+    {"exit", builtin_exit, 0},
+    {"echo", builtin_echo, BI_THREAD},
+    {"cd", builtin_cd, BI_FS},
+    {"mapfile", builtin_mapfile, 0},
+    {"readarray", builtin_mapfile, 0},
+    {"xargs", builtin_xargs, BI_FS},
+    {"coproc", builtin_coproc, BI_FS},
+    {"read", builtin_read, 0},
+    {"memo", builtin_memo, BI_FS},
+    {"cat", builtin_cat, BI_THREAD},
+    {"walk", builtin_walk, BI_THREAD},
+    {"fanout", builtin_fanout, BI_FS},
+    {"stats", builtin_stats, 0},
+    {"export", builtin_export, 0},
+    {"printf", builtin_printf, BI_THREAD}, // Salvo con -v (ver threadable_stage)
+    {"[[", builtin_cond, 0},
+    {"test", builtin_test, 0},
+    {"[", builtin_test, 0},
+};
+
+static const struct builtin *find_builtin(const char *name)
+{
+    for (size_t i = 0; i < sizeof(builtins) / sizeof(builtins[0]); i++)
+    {
+        if (strcmp(builtins[i].name, name) == 0)
+            return &builtins[i];
+    }
+    return NULL;
+}
+
+// ==================== launch_external ====================
+/*
+Ejecuta un comando externo y espera a que termine.
+- Windows: a través de cmd.exe /C.
+- Unix: fork + execvp, repartiendo en lotes las listas mayores que ARG_MAX.
+- Retorna: Código de salida del comando.
+*/
+static int launch_external(char **args)
+{
+    int status = 0;
+
+#ifdef _WIN32
+    // Windows: Usar cmd.exe con /C para ejecutar comandos
+    int arg_count = 0;
+    while (args[arg_count])
+        arg_count++;
+
+    // Crear array: ["cmd.exe", "/C", comando..., NULL]
+    char **cmd_args = xmalloc((arg_count + 3) * sizeof(char *));
+    cmd_args[0] = "cmd.exe";
+    cmd_args[1] = "/C";
+
+    for (int i = 0; i <= arg_count; i++)
+    {
+        cmd_args[i + 2] = args[i];
+    }
+
+    // Ejecutar y esperar
+    env_sync();
+    status = (int)_spawnvp(_P_WAIT, "cmd.exe", (const char *const *)cmd_args);
+    if (status == -1)
+    {
+        perror("shell");
+        status = 127;
+    }
+    free(cmd_args);
+
+#else
+    // Listas mayores que ARG_MAX: repartir en lotes o avisar sin hacer fork
+    long budget = arg_budget(), cost = 0;
+    int arg_count = 0;
+    for (; args[arg_count]; arg_count++)
+    {
+        if (arg_too_long(args[arg_count]))
+        {
+            fprintf(stderr, "shell: argumento demasiado largo: %.40s...\n", args[arg_count]);
+            return 126;
+        }
+        cost += arg_cost(args[arg_count]);
+    }
+
+    if (cost > budget)
+    {
+        if (!is_batchable(args[0]))
+        {
+            fprintf(stderr, "shell: %s: lista de argumentos demasiado larga "
+                            "(%ld bytes, máximo %ld); use xargs\n",
+                    args[0], cost, budget);
+            return 126;
+        }
+
+        // Prefijo fijo: el comando, sus opciones y un "--" opcional
+        int nprefix = 1;
+        while (args[nprefix] && args[nprefix][0] == '-')
+        {
+            if (strcmp(args[nprefix++], "--") == 0)
+                break;
+        }
+        return run_batches(args, nprefix, args + nprefix, arg_count - nprefix, 1, 0, 0);
+    }
+
+    // Unix: Crear proceso hijo
+    uint64_t t0 = probe_now();
+    pid_t pid = sh_fork();
+
+    if (pid < 0)
+    { // Error en fork
+        perror("shell");
+        status = 1;
+    }
+    else if (pid == 0)
+    { // Proceso hijo
+        if (exec_command(args) == -1)
+        {
+            perror("shell");
+            _exit(127); // _exit: exit() devolvería stdin a donde lo dejó el buffer y el script se leería dos veces
+        }
+    }
+    else
+    { // Proceso padre
+        int wstatus;
+        PROBE2(spawn, args[0], pid);
+        waitpid(pid, &wstatus, WUNTRACED); // Esperar al hijo
+        if (WIFEXITED(wstatus))
+            status = WEXITSTATUS(wstatus);
+        else if (WIFSIGNALED(wstatus))
+            status = 128 + WTERMSIG(wstatus);
+        else
+            status = 128 + WSTOPSIG(wstatus);
+        PROBE3(reap, pid, status, probe_now() - t0);
+    }
+#endif
+
+    return status;
+}
+
+// ==================== tuberías ====================
+/*
+Ejecuta "etapa1 | etapa2 | ... | etapaN".
+- Las etapas 1..N-1 se lanzan en procesos hijos conectados por pipes,
+  salvo los builtins BI_THREAD, que corren en un hilo del shell con sus
+  propios descriptores de entrada/salida (sin fork).
+- La última etapa corre en el propio shell con stdin redirigido, así
+  "... | read x" o "... | fanout a , b" actúan sobre el shell.
+- Retorna: El código de salida de la última etapa.
+- En Windows la línea entera va a cmd.exe, que ya entiende '|'.
+*/
+static int run_command(char **args);
+
+#ifndef _WIN32
+// En un hijo ya creado: redirecciones + builtin o execvp. No retorna.
+static void run_in_child(char **args)
+{
+    struct redir_save save;
+
+    if (apply_redirects(args, &save) != 0)
+        _exit(1);
+    if (!args[0])
+        _exit(0);
+
+    const struct builtin *b = find_builtin(args[0]);
+    if (b)
+    {
+        int status = b->fn(args);
+        out_flush();
+        _exit(status);
+    }
+    exec_command(args);
+    perror("shell");
+    _exit(127);
+}
+
+/*
+Lanza args en un hijo con stdin = in y stdout = out (-1 = heredado).
+- close_fds: descriptores que el hijo debe cerrar (extremos de otros pipes
+  que no se cerrarían solos si el hijo no llega a hacer exec).
+- Retorna: pid del hijo o -1.
+*/
+static pid_t spawn_command(char **args, int in, int out, const int *close_fds, int nclose)
+{
+    out_flush();
+    pid_t pid = sh_fork();
+    if (pid < 0)
+    {
+        perror("shell");
+        return -1;
+    }
+    if (pid == 0)
+    {
+        for (int i = 0; i < nclose; i++)
+        {
+            if (close_fds[i] >= 0)
+                close(close_fds[i]);
+        }
+        if (in >= 0)
+            dup2(in, 0);
+        if (out >= 0)
+            dup2(out, 1);
+        run_in_child(args);
+    }
+    PROBE2(spawn, args[0], pid);
+    return pid;
+}
+
+// Etapa de tubería que corre en un hilo del shell
+struct stage_thread
+{
+    pthread_t tid;
+    const struct builtin *b;
+    char **args;
+    int in, out; // Propiedad del hilo: los cierra al terminar
+    int status;
+    struct outbuf buf;
+};
+
+static void *stage_thread_main(void *arg)
+{
+    struct stage_thread *st = arg;
+
+    // Si el lector se va, write() debe fallar con EPIPE en vez de matar al
+    // shell; la señal pendiente de este hilo se descarta al terminar.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    st->buf.fd = st->out;
+    st->buf.len = 0;
+    cur_out = &st->buf;
+    cur_in = st->in;
+
+    st->status = st->b->fn(st->args);
+    out_flush();
+
+    if (st->in >= 0)
+        close(st->in);
+    close(st->out);
+    return NULL;
+}
+
+// ¿Puede la etapa correr en un hilo? (builtin BI_THREAD sin redirecciones ni -v)
+static const struct builtin *threadable_stage(char **stage)
+{
+    const struct builtin *b = find_builtin(stage[0]);
+    if (!b || !(b->flags & BI_THREAD))
+        return NULL;
+    if (b->fn == builtin_printf && stage[1] && strcmp(stage[1], "-v") == 0)
+        return NULL; // printf -v asigna una variable del shell
+    for (int i = 0; stage[i]; i++)
+    {
+        if (strchr(stage[i], '<') || strchr(stage[i], '>'))
+            return NULL;
+    }
+    return b;
+}
+
+static int run_pipeline(char **args)
+{
+    int nstages = 1;
+    for (int i = 0; args[i]; i++)
+    {
+        if (strcmp(args[i], "|") == 0)
+        {
+            if (i == 0 || !args[i + 1] || strcmp(args[i + 1], "|") == 0)
+            {
+                fprintf(stderr, "shell: error de sintaxis cerca de '|'\n");
+                return 2;
+            }
+            nstages++;
+        }
+    }
+
+    pid_t *pids = xmalloc(nstages * sizeof(pid_t));
+    struct stage_thread **threads = xmalloc(nstages * sizeof(*threads));
+    int *busy = xmalloc((2 * nstages + 1) * sizeof(int)); // fds de los hilos
+    int prev = -1, n = 0, nthreads = 0, nbusy = 0;
+    char **stage = args;
+    uint64_t t0 = probe_now();
+
+    out_flush();
+    for (int i = 0; n + nthreads < nstages - 1; i++)
+    {
+        if (strcmp(args[i], "|") != 0)
+            continue;
+
+        args[i] = NULL;
+        int fds[2];
+        if (pipe2(fds, O_CLOEXEC) < 0)
+        {
+            perror("shell");
+            break;
+        }
+
+        const struct builtin *b = threadable_stage(stage);
+        struct stage_thread *st = NULL;
+        if (b)
+        {
+            st = xmalloc(sizeof(*st));
+            st->b = b;
+            st->args = stage;
+            // Sin pipe previo: copia propia de stdin, porque el hilo principal
+            // redirigirá el descriptor 0 para la última etapa
+            st->in = prev >= 0 ? prev : fcntl(0, F_DUPFD_CLOEXEC, 3);
+            st->out = fds[1];
+            if (pthread_create(&st->tid, NULL, stage_thread_main, st) != 0)
+            {
+                free(st);
+                st = NULL;
+            }
+        }
+
+        if (st)
+        { // Los extremos pasan a ser del hilo; los hijos no deben heredarlos
+            threads[nthreads++] = st;
+            if (st->in >= 0)
+                busy[nbusy++] = st->in;
+            busy[nbusy++] = fds[1];
+        }
+        else
+        {
+            busy[nbusy] = fds[0];
+            pids[n++] = spawn_command(stage, prev, fds[1], busy, nbusy + 1);
+            close(fds[1]);
+            if (prev >= 0)
+                close(prev);
+        }
+        prev = fds[0];
+        stage = &args[i + 1];
+    }
+
+    // Última etapa en el shell, leyendo del último pipe
+    int status = 1;
+    if (n + nthreads == nstages - 1)
+    {
+        struct redir_save save = {{-1, -1, -1}};
+        redirect_to(&save, 0, prev);
+        close(prev);
+        prev = -1;
+        status = run_command(stage);
+        restore_redirects(&save);
+    }
+    if (prev >= 0)
+        close(prev);
+
+    for (int i = 0; i < n; i++)
+    {
+        int wstatus;
+        if (pids[i] > 0 && waitpid(pids[i], &wstatus, 0) == pids[i])
+            PROBE3(reap, pids[i], WIFEXITED(wstatus) ? WEXITSTATUS(wstatus) : 128 + WTERMSIG(wstatus),
+                   probe_now() - t0);
+    }
+    for (int i = 0; i < nthreads; i++)
+    {
+        pthread_join(threads[i]->tid, NULL);
+        free(threads[i]);
+    }
+    free(busy);
+    free(threads);
+    free(pids);
+    return status;
+}
+#endif
+
+// ==================== launch ====================
+/*
+Ejecuta una línea ya dividida en tokens: una tubería o un comando simple.
+- Una línea hecha solo de NOMBRE=VALOR asigna variables del shell.
+- Retorna: 1 para continuar ejecución, 0 para terminar.
+*/
+// Línea formada solo por asignaciones: se aplican en el shell
+static int run_assignments(char **args)
+{
+    for (int i = 0; args[i]; i++)
+    {
+        char *eq = assignment(args[i]);
+        *eq = '\0';
+        var_assign(args[i], eq + 1);
+        *eq = '=';
+    }
+    return 0;
+}
+
+static int run_command(char **args)
+{
+    struct redir_save save;
+    int status = 1;
+    int assigns = 1;
+
+    for (int i = 0; args[i] && assigns; i++)
+        assigns = assignment(args[i]) != NULL;
+
+    if (args[0] && assigns)
+        return run_assignments(args);
+    if (args[0] && strcmp(args[0], "[[") == 0)
+        return builtin_cond(args); // '<' y '>' son comparaciones, no redirecciones
+
+    if (apply_redirects(args, &save) == 0)
+    {
+        if (!args[0])
+            status = 0; // Solo redirecciones
+        else
+        {
+            const struct builtin *b = find_builtin(args[0]);
+            if (b)
+            {
+                uint64_t t0 = probe_now();
+                status = b->fn(args);
+                PROBE3(builtin, b->name, status, probe_now() - t0);
+                if (b->flags & BI_FS)
+                    stat_cache_clear();
+            }
+            else
+            {
+                status = launch_external(args);
+                stat_cache_clear(); // El proceso pudo crear o cambiar archivos
+            }
+        }
+    }
+    restore_redirects(&save);
+    return status;
+}
+
+int launch(char **args)
+{
+    if (!args[0])
+        return 1; // Línea vacía
+
+#ifndef _WIN32
+    int piped = 0;
+    for (int i = 0; args[i] && !piped; i++)
+        piped = strcmp(args[i], "|") == 0;
+    if (piped)
+    {
+        last_status = run_pipeline(args);
+        stat_cache_clear();
+    }
+    else
+#endif
+        last_status = run_command(args);
+
+    return !exit_requested; // Continuar ejecución salvo 'exit'
+}
+
+// ==================== listas y bucles ====================
+/*
+Una línea es una lista de comandos separados por ';' o saltos de línea
+(fuera de paréntesis, para no cortar <(a; b)).
+- Cada comando se expande justo antes de ejecutarlo, así el cuerpo de un
+  bucle ve los valores de cada iteración.
+- for NOMBRE in PALABRAS; do CUERPO; done recorre las palabras con el
+  generador de llaves: {1..1000000} se consume de una en una.
+- ((EXPR)) y for ((INICIO; CONDICIÓN; PASO)) usan el bytecode de la
+  sección de aritmética (sin expandir la línea ni lanzar 'seq').
+- CMD1 && CMD2 || CMD3 encadena comandos según su estado.
+- Los bucles pueden anidarse y ocupar varias líneas (main() sigue leyendo
+  mientras falte algún 'done').
+*/
+
+// El comando empieza por la palabra clave 'kw'
+static int seg_is(const char *seg, const char *kw)
+{
+    size_t len = strlen(kw);
+    while (isspace((unsigned char)*seg))
+        seg++;
+    return strncmp(seg, kw, len) == 0 &&
+           (!seg[len] || isspace((unsigned char)seg[len]) || seg[len] == '('); // "for((...))"
+}
+
+// El texto es "((EXPR))": deja EXPR en *src/*len
+static int arith_span(const char *seg, const char **src, size_t *len)
+{
+    size_t n;
+    while (isspace((unsigned char)*seg))
+        seg++;
+    n = strlen(seg);
+    while (n > 0 && isspace((unsigned char)seg[n - 1]))
+        n--;
+    if (n < 4 || strncmp(seg, "((", 2) != 0 || strncmp(seg + n - 2, "))", 2) != 0)
+        return 0;
+    *src = seg + 2;
+    *len = n - 4;
+    return 1;
+}
+
+/*
+Corta 'line' (se modifica) en comandos.
+- "do CMD" se separa en "do" y "CMD" para que el cuerpo empiece limpio.
+- Un '#' al principio de un comando lo descarta hasta el fin de línea.
+- Retorna: Número de comandos; *out (liberar con free()) apunta a cada uno.
+*/
+static size_t split_list(char *line, char ***out)
+{
+    size_t n = 0, cap = 8;
+    char **segs = xmalloc(cap * sizeof(char *));
+    char *p = line;
+    int depth = 0;
+
+    while (*p)
+    {
+        while (isspace((unsigned char)*p))
+            p++;
+        if (*p == '#')
+        { // Comentario: hasta el fin de línea
+            while (*p && *p != '\n')
+                p++;
+            continue;
+        }
+        char *start = p;
+        for (; *p; p++)
+        {
+            if (*p == '(')
+                depth++;
+            else if (*p == ')' && depth > 0)
+                depth--;
+            else if (depth == 0 && (*p == ';' || *p == '\n'))
+                break;
+        }
+        if (*p)
+            *p++ = '\0';
+
+        while (isspace((unsigned char)*start))
+            start++;
+        if (!*start)
+            continue; // Comando vacío
+
+        if (n + 2 > cap)
+        {
+            cap *= 2;
+            segs = xrealloc(segs, cap * sizeof(char *));
+        }
+        if (seg_is(start, "do") && start[2])
+        {
+            start[2] = '\0';
+            segs[n++] = start;
+            start += 3;
+            while (isspace((unsigned char)*start))
+                start++;
+        }
+        if (*start)
+            segs[n++] = start;
+    }
+    *out = segs;
+    return n;
+}
+
+/*
+Bucles 'for' sin su 'done' (main() lee más líneas mientras sea > 0).
+- El estado sigue de una línea a la siguiente: main() pasa solo la línea
+  nueva, sin volver a analizar todo lo acumulado.
+- Corta los comandos igual que split_list (';' y '\n' fuera de paréntesis,
+  "do CMD" como dos comandos).
+*/
+struct list_state
+{
+    int parens;   // Paréntesis abiertos: ';' y '\n' no cortan
+    int loops;    // 'for' sin cerrar
+    int at_start; // Lo siguiente empieza un comando
+};
+
+static int list_depth(struct list_state *ls, const char *line)
+{
+    for (const char *p = line; *p; p++)
+    {
+        if (ls->at_start && ls->parens == 0)
+        {
+            while (isspace((unsigned char)*p))
+                p++;
+            if (!*p)
+                break;
+            if (*p == '#')
+            { // Comentario: 'for' o 'done' dentro no cuentan
+                while (p[1] && p[1] != '\n')
+                    p++;
+                continue;
+            }
+            if (seg_is(p, "do"))
+            {
+                p += 1; // El cuerpo que sigue empieza otro comando
+                continue;
+            }
+            if (seg_is(p, "for"))
+                ls->loops++;
+            else if (seg_is(p, "done") && ls->loops > 0)
+                ls->loops--;
+            ls->at_start = 0;
+        }
+        if (*p == '(')
+            ls->parens++;
+        else if (*p == ')' && ls->parens > 0)
+            ls->parens--;
+        else if (ls->parens == 0 && (*p == ';' || *p == '\n'))
+            ls->at_start = 1;
+    }
+    return ls->loops;
+}
+
+// Un comando simple: expandir, dividir, llaves y ejecutar
+static int run_simple(const char *cmd)
+{
+    char *expanded = expand_line(cmd); // Expandir variables
+    int status = 1;
+
+    if (!expanded)
+    { // Expansión abortada por el límite de tamaño
+        procsub_close_all();
+        last_status = 1;
+        return 1;
+    }
+
+    char *words = NULL;
+    char **tokens = split_line(expanded); // Dividir en tokens
+    // Dentro de [[ ]] las llaves son de la expresión regular ({1,3})
+    char **args = tokens[0] && strcmp(tokens[0], "[[") == 0 ? tokens : brace_expand(tokens, &words);
+    if (args)
+        status = launch(args); // Ejecutar comando
+    else
+        last_status = 1;
+    procsub_close_all(); // Cerrar pipes de <(...) y >(...)
+
+    // Liberar memoria
+    if (args != tokens)
+        free(args);
+    free(words);
+    free(tokens);
+    free(expanded);
+    return status;
+}
+
+static int run_list(char **segs, size_t n);
+static int run_arith(const char *src, size_t len);
+
+// Un comando de una lista &&/||: ((EXPR)) o un comando simple
+static int run_one(const char *cmd)
+{
+    const char *src;
+    size_t len;
+    if (arith_span(cmd, &src, &len))
+        return run_arith(src, len);
+    return run_simple(cmd);
+}
+
+/*
+CMD1 && CMD2 || CMD3: cada parte se ejecuta o se salta según el estado de
+la última que se ejecutó. Los && y || dentro de [[ ]] o de paréntesis no
+cortan. 'seg' se corta temporalmente y queda como estaba (los cuerpos de
+los bucles se ejecutan más de una vez).
+*/
+static int run_andor(char *seg)
+{
+    int status = 1, run = 1, depth = 0, in_cond = 0;
+    char *part = seg;
+
+    for (char *p = seg;; p++)
+    {
+        int op = depth == 0 && !in_cond && p[0] && p[1] == p[0] && (p[0] == '&' || p[0] == '|');
+        if (*p && !op)
+        {
+            if (*p == '(')
+                depth++;
+            else if (*p == ')' && depth > 0)
+                depth--;
+            else if (p[0] == '[' && p[1] == '[' && (p == seg || isspace((unsigned char)p[-1])))
+                in_cond = 1;
+            else if (p[0] == ']' && p[1] == ']' && (!p[2] || isspace((unsigned char)p[2])))
+                in_cond = 0;
+            continue;
+        }
+
+        char save = *p;
+        *p = '\0';
+        if (run)
+            status = run_one(part);
+        *p = save;
+        if (!save || !status)
+            break;
+        run = save == '&' ? last_status == 0 : last_status != 0;
+        part = ++p + 1;
+    }
+    return status;
+}
+
+// ((EXPR)): estado 0 si EXPR no es cero
+static int run_arith(const char *src, size_t len)
+{
+    int64_t result;
+    last_status = arith_eval(src, len, &result) != 0 || result == 0;
+    return 1;
+}
+
+/*
+for ((INICIO; CONDICIÓN; PASO)) compilado a un único programa con la
+condición al final, para que cada vuelta cueste un solo salto:
+    INICIO; POP; JMP cond; arriba: YIELD; PASO; POP; cond: CONDICIÓN; JNZ arriba; END
+- "i++" y "i < N" se fusionan en superinstrucciones (OP_ADDI, OP_JCMP).
+- En cada YIELD se publican las variables asignadas, se ejecuta el cuerpo y
+  solo se recargan las ranuras si el cuerpo modificó alguna variable.
+- Con el cuerpo vacío no hay YIELD: el bucle entero corre en arith_run().
+*/
+static int run_arith_for(const char *src, size_t len, char **body, size_t nbody)
+{
+    const char *semi1 = memchr(src, ';', len);
+    const char *semi2 = semi1 ? memchr(semi1 + 1, ';', src + len - semi1 - 1) : NULL;
+    struct arith_prog prog = {0};
+    int status = 1, r = 0;
+
+    if (!semi2)
+    {
+        fprintf(stderr, "shell: uso: for ((INICIO; CONDICIÓN; PASO)); do ...; done\n");
+        last_status = 2;
+        return 1;
+    }
+
+    last_status = 1;
+    if (arith_compile(&prog, src, semi1 - src) == 0)
+    {
+        arith_emit(&prog, OP_POP, 0);
+        size_t to_cond = arith_emit(&prog, OP_JMP, 0);
+        size_t top = prog.len;
+        if (nbody)
+            arith_emit(&prog, OP_YIELD, 0);
+        size_t step = prog.len;
+        if (arith_compile(&prog, semi2 + 1, src + len - semi2 - 1) == 0)
+        {
+            arith_emit(&prog, OP_POP, 0);
+            arith_fuse_step(&prog, step);
+            prog.code[to_cond].arg = prog.len;
+            size_t cond = prog.len;
+            if (arith_compile(&prog, semi1 + 1, semi2 - semi1 - 1) == 0)
+            {
+                arith_fuse_cond(&prog, cond, top);
+                arith_emit(&prog, OP_END, 0);
+
+                int64_t *slots = xmalloc((prog.nnames ? prog.nnames : 1) * sizeof(int64_t));
+                int64_t result;
+                size_t pc = 0;
+                arith_load(&prog, slots);
+                last_status = 0;
+                while (status && (r = arith_run(&prog, slots, &pc, &result)) == 1)
+                {
+                    arith_store(&prog, slots);
+                    unsigned long gen = state_gen;
+                    status = run_list(body, nbody);
+                    if (state_gen != gen)
+                        arith_load(&prog, slots); // El cuerpo cambió variables
+                }
+                if (r < 0)
+                    last_status = 1;
+                arith_store(&prog, slots); // Valores finales visibles tras el bucle
+                free(slots);
+            }
+        }
+    }
+    arith_free(&prog);
+    return status;
+}
+
+// for NOMBRE in PALABRAS (cabecera) sobre los comandos del cuerpo
+static int run_for(const char *header, char **body, size_t nbody)
+{
+    const char *src;
+    size_t len;
+    char *expanded;
+    char **tokens;
+    int status = 1;
+
+    while (isspace((unsigned char)*header))
+        header++;
+    if (arith_span(header + 3, &src, &len))
+        return run_arith_for(src, len, body, nbody);
+
+    expanded = expand_line(header);
+    if (!expanded)
+    {
+        last_status = 1;
+        return 1;
+    }
+    tokens = split_line(expanded);
+    if (!tokens[1] || !valid_name(tokens[1]) || !tokens[2] || strcmp(tokens[2], "in") != 0)
+    {
+        fprintf(stderr, "shell: uso: for NOMBRE in PALABRAS; do ...; done\n");
+        last_status = 2;
+    }
+    else
+    {
+        last_status = 0; // Sin palabras, el bucle termina con éxito
+        for (int w = 3; tokens[w] && status; w++)
+        {
+            struct brace_gen gen;
+            const char *word;
+            brace_init(&gen, tokens[w]);
+            while (status && (word = brace_next(&gen)) != NULL)
+            {
+                var_set_scalar(tokens[1], word);
+                status = run_list(body, nbody);
+            }
+            brace_free(&gen);
+        }
+    }
+    free(tokens);
+    free(expanded);
+    return status;
+}
+
+/*
+Ejecuta una lista de comandos ya cortada por split_list().
+- Retorna: 1 para continuar ejecución, 0 para terminar ('exit').
+*/
+static int run_list(char **segs, size_t n)
+{
+    int status = 1;
+
+    for (size_t i = 0; i < n && status; i++)
+    {
+        if (!seg_is(segs[i], "for"))
+        {
+            status = run_andor(segs[i]);
+            continue;
+        }
+
+        // Buscar el 'done' que cierra este bucle
+        size_t end = i + 2;
+        int depth = 1;
+        for (; end < n; end++)
+        {
+            if (seg_is(segs[end], "for"))
+                depth++;
+            else if (seg_is(segs[end], "done") && --depth == 0)
+                break;
+        }
+        if (i + 1 >= n || !seg_is(segs[i + 1], "do") || end >= n)
+        {
+            fprintf(stderr, "shell: for: falta '%s'\n", i + 1 < n && seg_is(segs[i + 1], "do") ? "done" : "do");
+            last_status = 2;
+            return 1;
+        }
+        status = run_for(segs[i], segs + i + 2, end - i - 2);
+        i = end;
+    }
+    return status;
+}
+
+// ==================== snapshot de estado ====================
+/*
+--dump-state ARCHIVO / --load-state ARCHIVO
+- Guarda el estado del intérprete (hoy: las variables) en una imagen que
+  solo usa desplazamientos, así puede mapearse en cualquier dirección.
+- Al cargar, la imagen se mapea de solo lectura y los valores de las
+  variables apuntan dentro de ella (copy-on-write: una variable que se
+  reasigna pasa a tener su propio bloque). Solo se crean los arrays de spans.
+- Formato: state_header | state_var[nvars] | state_span[nspans] | textos
+*/
+#define STATE_MAGIC "SHSTATE1"
+
+struct state_header
+{
+    char magic[8];
+    uint64_t size;  // Tamaño total de la imagen
+    uint64_t nvars; // Registros state_var tras la cabecera
+};
+
+struct state_var
+{
+    uint64_t name_off; // Nombre terminado en '\0'
+    uint64_t items_off;
+    uint64_t count;
+};
+
+struct state_span
+{
+    uint64_t off;
+    uint64_t len;
+};
+
+int state_dump(const char *path)
+{
+    uint64_t nvars = 0, nspans = 0, text = 0;
+
+    for (int b = 0; b < VAR_BUCKETS; b++)
+    {
+        for (struct var *v = var_table[b]; v; v = v->next)
+        {
+            var_text(v); // Los enteros se guardan como texto
+            nvars++;
+            nspans += v->count;
+            text += strlen(v->name) + 1;
+            for (size_t i = 0; i < v->count; i++)
+                text += v->items[i].len;
+        }
+    }
+
+    uint64_t spans_base = sizeof(struct state_header) + nvars * sizeof(struct state_var);
+    uint64_t text_base = spans_base + nspans * sizeof(struct state_span);
+    uint64_t size = text_base + text;
+    char *image = xmalloc(size ? size : 1);
+    struct state_header *hdr = (struct state_header *)image;
+    struct state_var *sv = (struct state_var *)(image + sizeof(*hdr));
+    struct state_span *ss = (struct state_span *)(image + spans_base);
+    uint64_t pos = text_base;
+
+    memcpy(hdr->magic, STATE_MAGIC, 8);
+    hdr->size = size;
+    hdr->nvars = nvars;
+
+    for (int b = 0; b < VAR_BUCKETS; b++)
+    {
+        for (struct var *v = var_table[b]; v; v = v->next)
+        {
+            size_t len = strlen(v->name) + 1;
+            sv->name_off = pos;
+            memcpy(image + pos, v->name, len);
+            pos += len;
+            sv->items_off = (char *)ss - image;
+            sv->count = v->count;
+            for (size_t i = 0; i < v->count; i++, ss++)
+            {
+                ss->off = pos;
+                ss->len = v->items[i].len;
+                memcpy(image + pos, v->items[i].ptr, ss->len);
+                pos += ss->len;
+            }
+            sv++;
+        }
+    }
+
+    // Escribir a un temporal y publicar con rename
+    struct strbuf tmp = {0};
+    sb_append(&tmp, path, strlen(path));
+    sb_append(&tmp, ".tmp", 4);
+    FILE *f = fopen(tmp.data, "wb");
+    int ok = f && fwrite(image, 1, size, f) == size;
+    if (f && fclose(f) != 0)
+        ok = 0;
+    if (ok)
+    {
+        remove(path); // En Windows rename no sobrescribe
+        ok = rename(tmp.data, path) == 0;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "shell: --dump-state %s: %s\n", path, strerror(errno));
+        remove(tmp.data);
+    }
+
+    free(tmp.data);
+    free(image);
+    return ok ? 0 : -1;
+}
+
+// ¿Cabe [off, off+len) dentro de la imagen?
+static int state_in_bounds(uint64_t size, uint64_t off, uint64_t len)
+{
+    return off <= size && len <= size - off;
+}
+
+int state_load(const char *path)
+{
+    size_t size = 0;
+    char *image = NULL;
+    int err = 0; // errno de la llamada que falló (0: el archivo se leyó)
+
+#ifdef _WIN32
+    int fd = open(path, O_RDONLY | O_BINARY);
+    if (fd < 0)
+        err = errno;
+    else
+    {
+        if (!(image = read_all(fd, &size)))
+            err = errno;
+        close(fd);
+    }
+#else
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0)
+        err = errno;
+    else if (st.st_size > 0)
+    {
+        size = st.st_size;
+        image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image == MAP_FAILED)
+        {
+            err = errno;
+            image = NULL;
+        }
+    }
+    if (fd >= 0)
+        close(fd);
+#endif
+    if (err)
+    {
+        fprintf(stderr, "shell: --load-state %s: %s\n", path, strerror(err));
+        return -1;
+    }
+
+    const struct state_header *hdr = (const struct state_header *)image;
+    if (!image || size < sizeof(*hdr) || memcmp(hdr->magic, STATE_MAGIC, 8) != 0 || hdr->size != size ||
+        hdr->nvars > (size - sizeof(*hdr)) / sizeof(struct state_var))
+    {
+        fprintf(stderr, "shell: --load-state %s: imagen inválida\n", path);
+        return -1;
+    }
+
+    const struct state_var *sv = (const struct state_var *)(image + sizeof(*hdr));
+    for (uint64_t n = 0; n < hdr->nvars; n++, sv++)
+    {
+        const char *name = image + sv->name_off;
+        if (sv->name_off >= size || !memchr(name, '\0', size - sv->name_off) || !valid_name(name) ||
+            sv->items_off % _Alignof(struct state_span) != 0 || // Se lee como struct state_span
+            sv->count > size / sizeof(struct state_span) ||
+            !state_in_bounds(size, sv->items_off, sv->count * sizeof(struct state_span)))
+        {
+            fprintf(stderr, "shell: --load-state %s: variable corrupta\n", path);
+            return -1;
+        }
+
+        const struct state_span *ss = (const struct state_span *)(image + sv->items_off);
+        struct var *v = var_get(name);
+        var_clear(v); // Lo que tuviera antes deja de valer: no perder su bloque
+        v->backing_kind = BACK_IMAGE;
+        v->items = xmalloc((sv->count ? sv->count : 1) * sizeof(struct span));
+        for (uint64_t i = 0; i < sv->count; i++)
+        {
+            if (!state_in_bounds(size, ss[i].off, ss[i].len))
+            {
+                fprintf(stderr, "shell: --load-state %s: variable corrupta\n", path);
+                var_clear(v);
+                return -1;
+            }
+            v->items[i].ptr = image + ss[i].off;
+            v->items[i].len = ss[i].len;
+        }
+        v->count = sv->count;
+    }
+    return 0;
+}
+
+// ==================== fuzzing ====================
+/*
+Arnés de fuzzing del lector, las listas, la aritmética, [[ ]], la
+expansión (variables y llaves), el tokenizador y las redirecciones, todo en proceso y sin lanzar comandos (-DSHELL_FUZZ
+sustituye main() y desactiva <(...)/>(...)).
+- libFuzzer:  clang -g -O1 -fsanitize=fuzzer,address -DSHELL_FUZZ shell.c
+  (libFuzzer ya informa de exec/s; -timeout=1 caza los tiempos
+  superlineales).
+- AFL u otros: añadir -DSHELL_FUZZ_DRIVER; lee cada archivo indicado (o
+  stdin), lo ejecuta SHELL_FUZZ_RUNS veces y muestra en stderr las
+  ejecuciones por segundo y la entrada más lenta.
+- El mismo binario con --scaling SEMILLA... comprueba que el coste crece
+  linealmente con el tamaño de la línea (ver scaling_check()).
+*/
+#ifdef SHELL_FUZZ
+/*
+Deja el shell como al arrancar: $((x=...)) y [[ =~ ]] publican variables
+(x, BASH_REMATCH) y las pruebas de archivo llenan la caché de stat; sin
+esto el estado se acumularía entre entradas y una ejecución no sería
+reproducible por separado.
+*/
+static void fuzz_reset(void)
+{
+    for (size_t b = 0; b < VAR_BUCKETS; b++)
+    {
+        while (var_table[b])
+        {
+            struct var *v = var_table[b];
+            var_table[b] = v->next;
+            var_clear(v);
+            free(v->name);
+            free(v);
+        }
+    }
+    stat_cache_clear();
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+    char *line;
+
+    input_stream = fmemopen((void *)data, size, "r");
+    if (!input_stream)
+        return 0;
+    interactive = 0;
+    while ((line = read_line()) != NULL)
+    {
+        char **segs;
+        struct list_state ls = {0, 0, 1};
+        size_t len = strlen(line), cap = len + 1;
+        int loops = list_depth(&ls, line);
+        char *more;
+        while (loops > 0 && (more = read_line()))
+        { // Bucle sin cerrar: acumular líneas como main()
+            size_t more_len = strlen(more);
+            loops = list_depth(&ls, more);
+            if (len + more_len + 1 > cap)
+            {
+                cap = (len + more_len + 1) * 2;
+                line = xrealloc(line, cap);
+            }
+            memcpy(line + len, more, more_len + 1);
+            len += more_len;
+            free(more);
+        }
+        size_t n = split_list(line, &segs);
+        for (size_t s = 0; s < n; s++)
+        {
+            const char *src;
+            size_t len;
+            if (arith_span(segs[s], &src, &len))
+            { // ((EXPR)): compilar y evaluar sin publicar variables
+                struct arith_prog prog = {0};
+                if (arith_compile(&prog, src, len) == 0)
+                {
+                    int64_t *slots = xmalloc((prog.nnames ? prog.nnames : 1) * sizeof(int64_t));
+                    int64_t result;
+                    size_t pc = 0;
+                    arith_emit(&prog, OP_END, 0);
+                    arith_load(&prog, slots);
+                    arith_run(&prog, slots, &pc, &result);
+                    free(slots);
+                }
+                arith_free(&prog);
+                continue;
+            }
+            char *expanded = expand_line(segs[s]);
+            char *words = NULL;
+            if (!expanded)
+                continue;
+            char **tokens = split_line(expanded);
+            char **args = tokens[0] && strcmp(tokens[0], "[[") == 0 ? tokens : brace_expand(tokens, &words);
+            if (args && args[0] && strcmp(args[0], "[[") == 0)
+                builtin_cond(args); // Condiciones y expresiones regulares (sin procesos)
+            for (int i = 0; args && args[i]; i++)
+            {
+                int target, flags;
+                const char *rest = parse_redirect(args[i], &target, &flags);
+                if (rest && *rest == '&')
+                    (void)strtol(rest + 1, NULL, 10);
+            }
+            if (args != tokens)
+                free(args);
+            free(words);
+            free(tokens);
+            free(expanded);
+        }
+        free(segs);
+        free(line);
+    }
+    fclose(input_stream);
+    input_stream = NULL;
+    fuzz_reset();
+    return 0;
+}
+
+#ifdef SHELL_FUZZ_DRIVER
+#ifndef SHELL_FUZZ_RUNS
+#define SHELL_FUZZ_RUNS 1000
+#endif
+#define SCALING_LIMIT 4 // Máximo crecimiento del coste por byte de 10k a 1M
+
+// Tiempo medio (ns) de una ejecución, repitiendo hasta sumar 50 ms
+static double time_input(const char *data, size_t len)
+{
+    uint64_t runs = 0, t0 = now_us(), us;
+    do
+    {
+        LLVMFuzzerTestOneInput((const uint8_t *)data, len);
+        runs++;
+    } while ((us = now_us() - t0) < 50000);
+    return us * 1000.0 / runs;
+}
+
+/*
+--scaling SEMILLA...
+- Repite cada semilla (en copias enteras) en una sola línea hasta 1k, 10k,
+  100k y 1M bytes y muestra el coste por byte de cada tamaño.
+- Las semillas *.lineas conservan sus saltos de línea: así se mide también
+  la acumulación de un bucle sin cerrar a lo largo de muchas líneas.
+- Hay una semilla por etapa en tests/semillas ('make scaling').
+- Retorna: 1 si alguna crece más de SCALING_LIMIT veces de 10k a 1M
+  (comportamiento superlineal en alguna etapa), 0 si no.
+*/
+static int scaling_check(int argc, char **argv)
+{
+    static const size_t sizes[] = {1000, 10000, 100000, 1000000};
+    int failed = 0;
+
+    fprintf(stderr, "%-24s %10s %10s %10s %10s  (ns/byte)\n", "semilla", "1k", "10k", "100k", "1M");
+    for (int i = 0; i < argc; i++)
+    {
+        int fd = open(argv[i], O_RDONLY | O_BINARY);
+        size_t seed_len;
+        char *seed = fd >= 0 ? read_all(fd, &seed_len) : NULL;
+        double cost[4];
+        if (fd >= 0)
+            close(fd);
+        if (!seed || seed_len == 0)
+        {
+            fprintf(stderr, "%s: semilla vacía o ilegible\n", argv[i]);
+            free(seed);
+            failed = 1;
+            continue;
+        }
+        size_t name_len = strlen(argv[i]);
+        int keep_lines = name_len > 7 && strcmp(argv[i] + name_len - 7, ".lineas") == 0;
+        for (size_t j = 0; j < seed_len; j++)
+            if ((seed[j] == '\n' && !keep_lines) || seed[j] == '\0')
+                seed[j] = ' ';
+
+        const char *base = strrchr(argv[i], '/');
+        fprintf(stderr, "%-24s", base ? base + 1 : argv[i]);
+        for (int k = 0; k < 4; k++)
+        {
+            // Copias enteras: una semilla cortada daría un error en cada pasada
+            size_t size = sizes[k] > seed_len ? sizes[k] - sizes[k] % seed_len : seed_len;
+            char *data = xmalloc(size + 1);
+            for (size_t j = 0; j < size; j++)
+                data[j] = seed[j % seed_len];
+            data[size] = '\n';
+            cost[k] = time_input(data, size + 1) / size;
+            fprintf(stderr, " %10.2f", cost[k]);
+            free(data);
+        }
+        if (cost[3] > cost[1] * SCALING_LIMIT)
+        {
+            fprintf(stderr, "  SUPERLINEAL");
+            failed = 1;
+        }
+        fprintf(stderr, "\n");
+        free(seed);
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1 && strcmp(argv[1], "--scaling") == 0)
+        return scaling_check(argc - 2, argv + 2);
+
+    uint64_t total = 0, slowest = 0, execs = 0;
+    const char *slowest_name = "-";
+
+    for (int i = 1; i < argc || i == 1; i++)
+    {
+        int fd = i < argc ? open(argv[i], O_RDONLY | O_BINARY) : 0;
+        size_t len;
+        char *data = fd >= 0 ? read_all(fd, &len) : NULL;
+        if (fd > 0)
+            close(fd);
+        if (!data)
+        {
+            perror(i < argc ? argv[i] : "stdin");
+            continue;
+        }
+
+        uint64_t t0 = now_us();
+        for (int r = 0; r < SHELL_FUZZ_RUNS; r++)
+            LLVMFuzzerTestOneInput((const uint8_t *)data, len);
+        uint64_t us = (now_us() - t0) / SHELL_FUZZ_RUNS;
+        if (us >= slowest)
+        {
+            slowest = us;
+            slowest_name = i < argc ? argv[i] : "stdin";
+        }
+        total += us * SHELL_FUZZ_RUNS;
+        execs += SHELL_FUZZ_RUNS;
+        free(data);
+    }
+
+    fprintf(stderr, "%llu ejecuciones, %.0f exec/s, más lenta: %s (%llu µs)\n",
+            (unsigned long long)execs, total ? execs * 1e6 / total : 0.0,
+            slowest_name, (unsigned long long)slowest);
+    return 0;
+}
+#endif
+#endif
+
+// ==================== main ====================
+/*
+Función principal del shell.
+- Opciones: -c COMANDO, --dump-state ARCHIVO, --load-state ARCHIVO, --zygote,
+  --stats (JSON con contadores, tiempos y RSS máximo en stderr al salir),
+  --record ARCHIVO, --replay ARCHIVO [--speed N].
+- Sale con el estado de 'exit N' o del último comando; sin terminal no
+  muestra prompt, para poder comparar la salida con la de otros shells.
+- Bucle infinito: prompt → leer → expandir → dividir → ejecutar → liberar memoria.
+*/
+
+// Expande, divide y ejecuta una línea. Retorna: 0 si se pidió 'exit'
+static int run_line(const char *line)
+{
+    uint64_t before[ST_COUNT];
+    memcpy(before, stats, sizeof(before));
+    STAT_ADD(ST_COMMANDS, 1);
+
+    char *copy = xstrdup(line);
+    char **segs;
+    size_t n = split_list(copy, &segs); // Cortar en comandos
+    int status = run_list(segs, n);     // Ejecutar la lista
+    stat_cache_clear();                 // La caché de stat dura un comando compuesto
+    append_cache_clear();               // Igual que los '>>' abiertos
+
+    // Liberar memoria
+    free(segs);
+    free(copy);
+
+    for (int i = 0; i < ST_COUNT; i++)
+        cmd_stats[i] = stats[i] - before[i];
+    return status;
+}
+
+#ifndef SHELL_FUZZ
+static void usage(void)
+{
+    fprintf(stderr, "uso: shell [-c COMANDO] [--load-state ARCHIVO] [--dump-state ARCHIVO] [--zygote] [--stats]\n"
+                    "             [--record ARCHIVO | --replay ARCHIVO [--speed N]]\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *command = NULL, *dump_path = NULL, *record_path = NULL, *replay_path = NULL;
+    double speed = 1.0;
+    int zygote = 0, show_stats = 0;
+    char *line;
+    int status = 1;
+
+    stats_init();
+    for (int i = 1; i < argc; i++)
+    {
+        if (strcmp(argv[i], "--zygote") == 0 || strcmp(argv[i], "--stats") == 0)
+        {
+            zygote |= argv[i][2] == 'z';
+            show_stats |= argv[i][2] == 's';
+            continue;
+        }
+        if (!argv[i + 1])
+            usage();
+        if (strcmp(argv[i], "-c") == 0)
+            command = argv[++i];
+        else if (strcmp(argv[i], "--dump-state") == 0)
+            dump_path = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0)
+            record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0)
+            replay_path = argv[++i];
+        else if (strcmp(argv[i], "--speed") == 0)
+            speed = atof(argv[++i]);
+        else if (strcmp(argv[i], "--load-state") == 0)
+        {
+            if (state_load(argv[++i]) != 0)
+                return EXIT_FAILURE;
+        }
+        else
+            usage();
+    }
+
+    if ((record_path && input_record(record_path) != 0) ||
+        (replay_path && input_replay(replay_path, speed) != 0))
+        return EXIT_FAILURE;
+#ifdef _WIN32
+    interactive = replay_path || _isatty(0);
+#else
+    interactive = replay_path || isatty(0);
+#endif
+
+#ifndef _WIN32
+    if (zygote)
+        zygote_start(); // Con el estado ya cargado
+#else
+    (void)zygote;
+#endif
+
+    if (command)
+        status = run_line(command);
+
+    while (!command && status) // Continuar hasta recibir 'exit' o EOF
+    {
+        service_events(); // Recoger hijos en segundo plano
+        if (interactive)
+        {
+            printf("shell> "); // Mostrar prompt
+            fflush(stdout);    // Asegurar que se imprime
+        }
+
+        line = read_line(); // Leer línea
+        if (!line)
+            break;
+        struct list_state ls = {0, 0, 1};
+        size_t len = strlen(line), cap = len + 1;
+        int loops = list_depth(&ls, line);
+        while (loops > 0)
+        { // Bucle sin terminar: seguir leyendo líneas
+            char *more;
+            if (interactive)
+            {
+                printf("> ");
+                fflush(stdout);
+            }
+            if (!(more = read_line()))
+                break; // EOF: run_line() informará del 'done' que falta
+            size_t more_len = strlen(more);
+            loops = list_depth(&ls, more);
+            if (len + more_len + 1 > cap)
+            { // Crecer al doble: acumular N líneas cuesta O(N)
+                cap = (len + more_len + 1) * 2;
+                line = xrealloc(line, cap);
+            }
+            memcpy(line + len, more, more_len + 1);
+            len += more_len;
+            free(more);
+        }
+        status = run_line(line);
+        free(line);
+    }
+
+    if (show_stats)
+        stats_dump_json(stderr);
+    if (dump_path && state_dump(dump_path) != 0)
+        return EXIT_FAILURE;
+    return last_status; // Como sh: el de 'exit N' o el del último comando
+}
+#endif
@@ -0,0 +1,12 @@
+# ((...)) y $((...)) compilados a bytecode
+x=3
+((x = x * 7 + 1))
+echo $x
+echo $((x / 2)) $((x % 5)) $((1 - 10))
+((y = x > 20))
+echo $y
+i=0
+((i++))
+((i += 10))
+echo $i
+echo $((2 + 3 * 4 - (8 - 2) / 3))
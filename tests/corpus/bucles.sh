@@ -0,0 +1,11 @@
+# for con listas, en varias líneas y al estilo C
+for x in a b c; do echo $x; done
+for n in 1 2 3
+do
+  echo linea $n
+done
+for ((i = 0; i < 4; i++)); do echo i=$i; done
+for a in x y; do for b in 1 2; do echo $a$b; done; done
+total=0
+for ((i = 1; i <= 100; i++)); do ((total += i)); done
+echo $total
@@ -0,0 +1,4 @@
+# pendiente: el shell todavía no quita comillas ni barras invertidas
+echo "hola mundo"
+echo 'sin $expandir'
+echo a\ b
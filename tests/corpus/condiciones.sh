@@ -0,0 +1,12 @@
+# [[ ]] con patrones, =~ y cortocircuito
+v=archivo.txt
+[[ $v == *.txt ]] && echo txt
+[[ $v == *.c ]] || echo noc
+[[ $v != *.c ]] && echo distinto
+[[ 3 -lt 10 ]] && echo menor
+[[ abc =~ ^a(b)c$ ]] && echo ${BASH_REMATCH[1]}
+[[ a < b ]] && echo orden
+[[ -z $nada ]] && echo vacio
+[[ 1 -eq 2 ]]
+echo estado $?
+[[ {a,b} == {a,b} ]] && echo sin-llaves
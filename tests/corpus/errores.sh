@@ -0,0 +1,6 @@
+# stderr: presencia
+# Comandos inexistentes y archivos que faltan
+comando-que-no-existe
+echo $?
+cat noexiste.txt
+echo sigue
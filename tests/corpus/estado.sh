@@ -0,0 +1,10 @@
+# Estado de salida de comandos, listas y exit
+true
+echo $?
+false
+echo $?
+false || echo recuperado
+true && echo siguiente
+grep -q nada /dev/null
+echo $?
+exit 3
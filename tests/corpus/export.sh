@@ -0,0 +1,8 @@
+# export: las variables exportadas llegan a los procesos hijos
+export SALUDO=hola
+env | grep ^SALUDO=
+SALUDO=adios
+env | grep ^SALUDO=
+export NUEVO=1
+((NUEVO += 4))
+env | grep ^NUEVO=
@@ -0,0 +1,10 @@
+# Expansión de llaves, incluida la generación perezosa de rangos
+echo {a,b,c}
+echo pre{1,2}post
+echo {1..5}
+echo {a..e}
+echo {x,y}{1,2}
+echo {1..3}-{a,b}
+echo sin{llave
+echo {uno}
+for f in {1..3}; do echo f$f; done
@@ -0,0 +1,7 @@
+# mapfile / readarray desde archivo
+for i in a b c d; do echo linea-$i >> m.txt; done
+mapfile -t lineas < m.txt
+echo ${lineas[0]}
+echo ${lineas[3]}
+readarray -t otras < m.txt
+echo ${otras[2]}
@@ -0,0 +1,8 @@
+# printf con formatos cacheados
+printf %s-%d: a 1; echo
+printf %05d 42; echo
+printf %x 255; echo
+printf %s, uno dos tres; echo
+printf %-5s] ab; echo
+printf %3d 7; echo
+for i in 1 2 3; do printf [%d] $i; done; echo
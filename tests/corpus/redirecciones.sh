@@ -0,0 +1,10 @@
+# Redirecciones y '>>' repetido dentro de un bucle
+echo uno > r.txt
+echo dos >> r.txt
+cat r.txt
+for i in 1 2 3; do echo vuelta $i >> r.txt; done
+cat r.txt
+echo error 1>&2 2>/dev/null
+cat < r.txt > copia.txt
+cat copia.txt
+echo fin
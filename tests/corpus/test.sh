@@ -0,0 +1,12 @@
+# test / [ y pruebas de archivo
+[ 1 -eq 1 ] && echo igual
+test 2 -gt 3 || echo nomayor
+[ abc = abc ] && echo cadena
+[ abc != abd ] && echo distinta
+echo dato > f.txt
+[ -f f.txt ] && echo existe
+[ -s f.txt ] && echo novacio
+[ -d f.txt ] || echo nodir
+[ -e noexiste ] || echo falta
+[ ! -e noexiste ] && echo negado
+[ -f f.txt -a -s f.txt ] && echo ambas
@@ -0,0 +1,7 @@
+# Tuberías con builtins y externos, y xargs
+echo uno dos tres | wc -w
+echo a b c | xargs echo x
+for i in 1 2 3; do echo n$i >> n.txt; done
+cat n.txt | sort -r | head -2
+printf %s, a b | cat
+echo fin | cat | cat
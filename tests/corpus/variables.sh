@@ -0,0 +1,9 @@
+# Asignación, expansión y concatenación de variables
+a=hola
+b=mundo
+echo $a $b
+echo ${a}-${b}
+c=$a$b
+echo $c
+n=5
+echo $n $nada fin
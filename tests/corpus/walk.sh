@@ -0,0 +1,6 @@
+# solo: shell
+# walk recorre el árbol en paralelo; se ordena para que sea determinista
+mkdir -p d/e/f
+echo x > d/a.txt
+echo y > d/e/b.txt
+walk d | sort
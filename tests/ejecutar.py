@@ -0,0 +1,159 @@
+#!/usr/bin/env python3
+"""
+ejecutar.py - Compara el shell con shells de referencia sobre tests/corpus.
+
+Cada script del corpus se pasa por stdin (como 'shell < script.sh') al
+shell, al de referencia y a los de comparación, cada uno en un directorio
+temporal vacío. Se comparan stdout, stderr y el estado de salida con los
+de la referencia y se muestra una tabla con el tiempo real y el RSS máximo
+de cada uno, medidos con tests/medir (wait4, igual para todos los shells;
+para el shell es el mismo max_rss_kb que da el JSON de --stats).
+
+Directivas en las primeras líneas de comentario del script:
+- '# stderr: presencia': solo se compara si stderr está vacío o no (los
+  mensajes de error cambian de un shell a otro).
+- '# solo: shell': usa algo que los demás no tienen; stdout se compara con
+  NOMBRE.esperado y el estado con '# estado: N' (0 si no hay).
+- '# pendiente: MOTIVO': diferencia conocida; no cuenta como fallo.
+
+Uso: tests/ejecutar.py [--shell RUTA] [--medir RUTA] [--ref SHELL]
+                       [--comparar SHELL,...] [--repeticiones N] [SCRIPT...]
+('make test' compila el shell y medir y lo ejecuta con todo el corpus.)
+Retorna: 1 si algún script no coincide con la referencia, 0 si todos.
+"""
+
+import argparse
+import os
+import re
+import shutil
+import signal
+import subprocess
+import sys
+import tempfile
+
+RAIZ = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+CORPUS = os.path.join(RAIZ, "tests", "corpus")
+LIMITE_S = 10  # Un script que tarde más se da por colgado
+
+
+def directivas(ruta):
+    """Lee las directivas '# clave: valor' del comentario inicial."""
+    d = {}
+    with open(ruta, encoding="utf-8") as f:
+        for linea in f:
+            m = re.match(r"#\s*(stderr|solo|pendiente|estado):\s*(.*)", linea)
+            if m:
+                d[m.group(1)] = m.group(2).strip()
+            elif not linea.startswith("#"):
+                break
+    return d
+
+
+def ejecutar(medir, argv, script):
+    """Corre 'argv < script' en un directorio nuevo.
+    Retorna: (stdout, stderr, estado, segundos, RSS máximo en KB)."""
+    with tempfile.TemporaryDirectory(prefix="corpus-") as dir, \
+            tempfile.NamedTemporaryFile("r", prefix="medir-") as uso, \
+            open(script, "rb") as entrada:
+        # Sesión propia: si se cuelga se mata también al shell, no solo a medir
+        p = subprocess.Popen([medir, uso.name] + argv, stdin=entrada, stdout=subprocess.PIPE,
+                             stderr=subprocess.PIPE, cwd=dir, start_new_session=True)
+        try:
+            out, err = p.communicate(timeout=LIMITE_S)
+        except subprocess.TimeoutExpired:
+            os.killpg(p.pid, signal.SIGKILL)
+            out, _ = p.communicate()
+            return out, b"colgado", -1, LIMITE_S, 0
+        us, rss = uso.read().split()
+        return out, err, p.returncode, int(us) / 1e6, int(rss)
+
+
+def medir_n(medir, argv, script, repeticiones):
+    """Como ejecutar(), con el menor tiempo y el mayor RSS de N pasadas."""
+    r = ejecutar(medir, argv, script)
+    tiempo, rss = r[3], r[4]
+    for _ in range(repeticiones - 1):
+        otra = ejecutar(medir, argv, script)
+        tiempo, rss = min(tiempo, otra[3]), max(rss, otra[4])
+    return r[0], r[1], r[2], tiempo, rss
+
+
+def diferencias(a, b, stderr):
+    """Lo que difiere entre dos resultados (stdout, stderr, estado)."""
+    malas = []
+    if a[0] != b[0]:
+        malas.append("stdout")
+    if (bool(a[1]) != bool(b[1])) if stderr == "presencia" else (a[1] != b[1]):
+        malas.append("stderr")
+    if a[2] != b[2]:
+        malas.append("estado %d/%d" % (a[2], b[2]))
+    return malas
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Corpus de compatibilidad y rendimiento")
+    ap.add_argument("--shell", default=os.path.join(RAIZ, "shell"))
+    ap.add_argument("--medir", default=os.path.join(RAIZ, "tests", "medir"))
+    ap.add_argument("--ref", default="bash")
+    ap.add_argument("--comparar", default="dash",
+                    help="otros shells para la tabla, separados por comas (vacío: ninguno)")
+    ap.add_argument("--repeticiones", type=int, default=1)
+    ap.add_argument("scripts", nargs="*")
+    args = ap.parse_args()
+    if not os.access(args.medir, os.X_OK):
+        sys.exit("%s: no existe; compilarlo con 'make tests/medir'" % args.medir)
+
+    shells = [("shell", [os.path.abspath(args.shell)])]
+    for nombre in [args.ref] + [s for s in args.comparar.split(",") if s and s != args.ref]:
+        if shutil.which(nombre):
+            shells.append((nombre, [nombre]))
+        elif nombre == args.ref:
+            sys.exit("%s: no encontrado" % nombre)
+    scripts = args.scripts or sorted(
+        os.path.join(CORPUS, f) for f in os.listdir(CORPUS) if f.endswith(".sh"))
+
+    cab = "%-18s" % "script"
+    for nombre, _ in shells:
+        cab += " %18s" % (nombre + " ms/KB")
+    print(cab + "  resultado")
+
+    fallos = 0
+    for script in scripts:
+        d = directivas(script)
+        fila = "%-18s" % os.path.basename(script)
+        resultados = {}
+        for nombre, argv in shells:
+            if nombre == "shell" or "solo" not in d:
+                resultados[nombre] = medir_n(args.medir, argv, script, args.repeticiones)
+        propio = resultados["shell"]
+        if "solo" in d:
+            base = os.path.splitext(script)[0]
+            with open(base + ".esperado", "rb") as f:
+                ref = (f.read(), b"", int(d.get("estado", "0")))
+        else:
+            ref = resultados[args.ref]
+
+        for nombre, _ in shells:  # Una columna por shell, en el orden de la cabecera
+            r = resultados.get(nombre)
+            if r is None:
+                fila += " %18s" % "-"
+                continue
+            marca = "*" if nombre != args.ref and diferencias(r, ref, d.get("stderr")) else " "
+            fila += " %11.1f/%5d%s" % (r[3] * 1000, r[4], marca)
+
+        malas = diferencias(propio, ref, d.get("stderr"))
+        if not malas:
+            fila += "  ok" + ("  (pendiente resuelto: quitar la directiva)" if "pendiente" in d else "")
+        elif "pendiente" in d:
+            fila += "  pendiente: " + d["pendiente"]
+        else:
+            fila += "  FALLA: " + ", ".join(malas)
+            fallos += 1
+        print(fila)
+
+    print("* = la salida difiere de %s" % args.ref)
+    return 1 if fallos else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
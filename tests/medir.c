@@ -0,0 +1,69 @@
+/*
+medir.c - Ejecuta un comando y anota su tiempo real y RSS máximo.
+
+Lo usa tests/ejecutar.py. Python no puede medirlo directamente: en Linux
+el ru_maxrss de un proceso incluye el del proceso que lo lanzó (se hereda
+a través de fork + exec), así que todo lo que lance Python marca al menos
+lo que ocupa Python. Este programa es pequeño y lanza el comando con su
+propio fork, de modo que el RSS que devuelve wait4 es solo el del comando.
+
+Uso: medir ARCHIVO COMANDO [ARGS...]
+- Escribe "MICROSEGUNDOS RSS_KB\n" en ARCHIVO.
+- Sale con el estado del comando (128 + señal si murió por una señal).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+int main(int argc, char **argv)
+{
+    struct timespec t0, t1;
+    struct rusage ru;
+    int wstatus;
+
+    if (argc < 3)
+    {
+        fprintf(stderr, "uso: medir ARCHIVO COMANDO [ARGS...]\n");
+        return 2;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        perror("medir");
+        return 2;
+    }
+    if (pid == 0)
+    {
+        execvp(argv[2], &argv[2]);
+        perror(argv[2]);
+        _exit(127);
+    }
+    if (wait4(pid, &wstatus, 0, &ru) < 0)
+    {
+        perror("medir");
+        return 2;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    FILE *f = fopen(argv[1], "w");
+    if (!f)
+    {
+        perror(argv[1]);
+        return 2;
+    }
+    fprintf(f, "%lld %ld\n",
+            (long long)(t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000,
+            ru.ru_maxrss);
+    fclose(f);
+
+    if (WIFSIGNALED(wstatus))
+        return 128 + WTERMSIG(wstatus);
+    return WEXITSTATUS(wstatus);
+}